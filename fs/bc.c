@@ -1,6 +1,51 @@
 
 #include "fs.h"
 
+// Block cache statistics, reported to clients by FSREQ_STATS.
+struct FsStats fs_stats;
+
+// Read-ahead.  A fault on the block just past the previous read
+// doubles the window, up to BC_MAXRUN blocks (one IDE command); any
+// other fault shrinks it back to a single block.
+
+static uint32_t ra_start;	// first block of the last read
+static uint32_t ra_len;		// blocks in the last read
+static uint32_t ra_window = 1;	// blocks to read on the next fault
+
+// Resident blocks, for CLOCK eviction once BC_NBLOCKS are cached.
+// A slot holds a block number, 0 if it is free, or BC_RESERVED while
+// bc_read is filling it.  A slot whose block is no longer mapped
+// is as good as free.
+#define BC_RESERVED	((uint32_t) -1)
+
+static uint32_t bc_ring[BC_NBLOCKS];
+static uint32_t bc_hand;
+static bool bc_untracked;	// some mapped block has no slot
+
+// Reads started by bc_get.  Load i reads into the pages at
+// BC_LOADVA + i * BC_MAXRUN * BLKSIZE and maps them into the cache only
+// once the disk is done, so no other request sees a block before its
+// contents arrive.
+#define BC_NLOAD	8
+
+struct BcLoad {
+	uint32_t l_blockno;		// first block being read
+	uint32_t l_n;			// number of blocks
+	volatile uint32_t l_busy;
+};
+
+static struct BcLoad bc_loads[BC_NLOAD];
+
+// Set while in bc_pgfault, which runs on the exception stack and so
+// must not switch threads (see serve_wait).
+bool bc_faulting;
+
+// The page fault handler that was in place before bc_init, which gets
+// the faults outside the block cache (copy-on-write faults after the
+// fs forked its timer, for instance).
+extern void (*_pgfault_handler)(struct UTrapframe *utf);
+static void (*bc_prev_pgfault)(struct UTrapframe *utf);
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -24,16 +69,183 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// Count the blocks of the last read-ahead that have been used since.
+// bc_read clears the accessed bits when it maps the blocks in, so a
+// set bit means a reference that the read-ahead saved from faulting.
+static void
+bc_ra_account(void)
+{
+	uint32_t i;
+	void *va;
+
+	for (i = 1; i < ra_len; i++) {
+		va = (void*) (DISKMAP + (ra_start + i) * BLKSIZE);
+		if (va_is_mapped(va) && (uvpt[PGNUM(va)] & PTE_A))
+			fs_stats.fs_ra_hits++;
+	}
+	ra_len = 0;
+}
+
+// Write back block 'va' to make room in the cache.  Without a journal
+// to make the two one update, a block that may point to newly
+// allocated blocks must not reach the disk before the bitmap blocks
+// that mark them in use.
+static void
+bc_flush_evicted(void *va)
+{
+	uint32_t blockno = ((uint32_t) va - DISKMAP) / BLKSIZE;
+
+	if (bitmap && !journal_on() && va_is_dirty(va)
+	    && (blockno < 2 || blockno >= 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE))
+		bitmap_flush();
+	flush_block(va);
+}
+
+// Find a slot for one more resident block, evicting a block if the
+// cache is full.  The hand gives a block whose accessed bit is set a
+// second chance: it clears the bit (writing the block back first if it
+// is dirty, since remapping clears PTE_D too) and moves on.  Blocks
+// that are also mapped by clients (see serve_map_blocks), or that belong
+// to the uncommitted journal transaction, are left alone.
+// Returns the slot, marked BC_RESERVED, or NULL if two sweeps found
+// nothing to evict; the block then simply goes untracked.
+static uint32_t *
+bc_slot(void)
+{
+	uint32_t *slot, n, blockno;
+	void *va;
+	int r;
+
+	for (n = 0; n < 2 * BC_NBLOCKS; n++) {
+		slot = &bc_ring[bc_hand];
+		bc_hand = (bc_hand + 1) % BC_NBLOCKS;
+		if (*slot == BC_RESERVED)
+			continue;
+		va = (void*) (DISKMAP + *slot * BLKSIZE);
+		if (*slot == 0 || !va_is_mapped(va))
+			goto found;
+		if (pageref(va) > 1 || journal_busy(*slot))
+			continue;
+		if (uvpt[PGNUM(va)] & PTE_A) {
+			if (va_is_dirty(va))
+				bc_flush_evicted(va);
+			else if ((r = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+				panic("bc_slot: sys_page_map: %e", r);
+			continue;
+		}
+
+		// Other requests run while the block is written back, and
+		// may use it again or take the slot.
+		blockno = *slot;
+		bc_flush_evicted(va);
+		if (*slot != blockno)
+			continue;
+		if (va_is_mapped(va)) {
+			if (uvpt[PGNUM(va)] & (PTE_A|PTE_D))
+				continue;
+			if ((r = sys_page_unmap(0, va)) < 0)
+				panic("bc_slot: sys_page_unmap: %e", r);
+			fs_stats.fs_evictions++;
+		}
+		goto found;
+	}
+	return 0;
+
+found:
+	*slot = BC_RESERVED;
+	return slot;
+}
+
+// Read block 'blockno' into the cache, together with as much of the
+// read-ahead window as is not already cached.  From bc_pgfault the
+// blocks are read straight into place.  Otherwise 'l' is a load that
+// says where to read them, and they are mapped into the cache once
+// they are in, except any that a fault brought in meanwhile.
+static void
+bc_read(uint32_t blockno, struct BcLoad *l)
+{
+	char *addr = (char*) (DISKMAP + blockno * BLKSIZE), *buf, *va;
+	uint32_t i, n, *slots[BC_MAXRUN];
+	int r;
+
+	fs_stats.fs_faults++;
+
+	// Grow the window on sequential access, and clip it at the end of
+	// the disk and at the first block that is already cached.
+	if (blockno == ra_start + ra_len)
+		ra_window = MIN(ra_window * 2, BC_MAXRUN);
+	else
+		ra_window = 1;
+	bc_ra_account();
+	n = 1;
+	if (super)
+		while (n < ra_window && blockno + n < super->s_nblocks
+		       && !va_is_mapped(addr + n * BLKSIZE))
+			n++;
+	ra_start = blockno;
+	ra_len = n;
+	fs_stats.fs_ra_blocks += n - 1;
+	fs_stats.fs_ra_window = ra_window;
+
+	buf = addr;
+	if (l) {
+		l->l_blockno = blockno;
+		l->l_n = n;
+		buf = (char*) (BC_LOADVA + (l - bc_loads) * BC_MAXRUN * BLKSIZE);
+	}
+
+	// Make room before mapping anything, so that eviction cannot pick
+	// the blocks we are about to read.
+	for (i = 0; i < n; i++)
+		slots[i] = bc_slot();
+
+	for (i = 0; i < n; i++)
+		if ((r = sys_page_alloc(0, buf + i * BLKSIZE, PTE_P|PTE_W|PTE_U)) < 0)
+			panic("bc_read: sys_page_alloc failed: %e\n", r);
+	if ((r = ide_read(blockno * BLKSECTS, buf, n * BLKSECTS)) < 0)
+		panic("bc_read: ide_read failed: %e\n", r);
+
+	// Clear the dirty (and accessed) bits for the disk block pages
+	// since we just read the blocks from disk.  A new mapping starts
+	// out with both clear.
+	for (i = 0; i < n; i++) {
+		va = addr + i * BLKSIZE;
+		if (!l)
+			r = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL);
+		else if (va_is_mapped(va)
+			 || (r = sys_page_map(0, buf + i * BLKSIZE, 0, va, PTE_P|PTE_W|PTE_U)) >= 0)
+			r = sys_page_unmap(0, buf + i * BLKSIZE);
+		if (r < 0)
+			panic("in bc_read, sys_page_map: %e", r);
+		if (slots[i])
+			*slots[i] = blockno + i;
+		else
+			bc_untracked = 1;
+	}
+
+	// Check that the block we read was allocated. (exercise for
+	// the reader: why do we do this *after* reading the block
+	// in?)
+	if (bitmap && block_is_free(blockno))
+		panic("reading free block %08x\n", blockno);
+}
+
 // Fault any disk block that is read in to memory by
-// loading it from disk.
+// loading it from disk, together with as much of the read-ahead
+// window as is not already cached.
 static void
 bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
-	int r;
+	bool faulting;
 
 	// Check that the fault was within the block cache region
+	if ((addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
+	    && bc_prev_pgfault) {
+		bc_prev_pgfault(utf);
+		return;
+	}
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
 		panic("page fault in FS: eip %08x, va %08x, err %04x",
 		      utf->utf_eip, addr, utf->utf_err);
@@ -42,39 +254,81 @@ bc_pgfault(struct UTrapframe *utf)
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
-	// Allocate a page in the disk map region, read the contents
-	// of the block from the disk into that page.
-	// Hint: first round addr to page boundary. fs/ide.c has code to read
-	// the disk.
-	//
-	// LAB 5: you code here:
-    addr = ROUNDDOWN(addr, BLKSIZE);
-    if ((r = sys_page_alloc(thisenv->env_id, addr, PTE_P | PTE_W | PTE_U)) < 0)
-    {
-        panic("bc_pgfault: sys_page_alloc failed: %e\n", r);
-    }
-    uint32_t sectno = blockno * BLKSECTS;
-    if ((r = ide_read(sectno, addr, BLKSECTS)) < 0)
-    {
-        panic("bc_pgfault: ide_read failed: %e\n", r);
-    }
+	fs_stats.fs_lookups++;
 
-	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-		panic("in bc_pgfault, sys_page_map: %e", r);
+	// The free block check in bc_read can fault in turn.
+	faulting = bc_faulting;
+	bc_faulting = 1;
+	bc_read(blockno, NULL);
+	bc_faulting = faulting;
+}
 
-	// Check that the block we read was allocated. (exercise for
-	// the reader: why do we do this *after* reading the block
-	// in?)
-	if (bitmap && block_is_free(blockno))
-		panic("reading free block %08x\n", blockno);
+// Return the address of block 'blockno', reading the block in first
+// if it is not cached.  Touching an uncached block faults, which holds
+// up every request until bc_pgfault is done with the disk; reading it
+// here lets other requests run meanwhile.
+void*
+bc_get(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+	struct BcLoad *l, *free;
+
+	// A miss while faulting is counted by the fault it leads to.
+	if (!bc_faulting || va_is_mapped(addr))
+		fs_stats.fs_lookups++;
+	while (!bc_faulting && !va_is_mapped(addr)) {
+		free = NULL;
+		for (l = bc_loads; l < bc_loads + BC_NLOAD; l++) {
+			if (!l->l_busy && !free)
+				free = l;
+			if (l->l_busy && blockno >= l->l_blockno
+			    && blockno < l->l_blockno + l->l_n)
+				break;
+		}
+
+		// Wait for a load that is already reading the block, or for
+		// any load if all are busy, then look again.
+		if (l < bc_loads + BC_NLOAD || !free) {
+			if (l == bc_loads + BC_NLOAD)
+				l = bc_loads;
+			serve_wait(&l->l_busy, 1);
+			continue;
+		}
+		free->l_busy = 1;
+		bc_read(blockno, free);
+		free->l_busy = 0;
+		serve_wakeup(&free->l_busy);
+	}
+	return addr;
+}
+
+// Make page 'pg', which holds new contents for block 'blockno', the
+// cached copy of the block, dirty so that it gets written back.  The
+// page stays mapped at 'pg' too.
+void
+bc_insert(uint32_t blockno, void *pg)
+{
+	volatile char *va = diskaddr(blockno);
+	uint32_t *slot;
+	int r;
+
+	slot = bc_slot();
+	if ((r = sys_page_map(0, pg, 0, (void*) va, PTE_P|PTE_W|PTE_U)) < 0)
+		panic("bc_insert: sys_page_map: %e", r);
+	va[0] = va[0];
+	if (slot)
+		*slot = blockno;
+	else
+		bc_untracked = 1;
 }
 
 // Flush the contents of the block containing VA out to disk if
-// necessary, then clear the PTE_D bit using sys_page_map.
-// If the block is not in the block cache or is not dirty, does
-// nothing.
+// necessary, clearing the PTE_D bit using sys_page_map.
+// If the block is not in the block cache or is not dirty, or is held
+// back by the journal, does nothing.
+// The bit is cleared before the write: ide_write works from a copy of
+// the block, and if another request changes the block while the write
+// is in progress, that leaves it dirty rather than losing the change.
 // Hint: Use va_is_mapped, va_is_dirty, and ide_write.
 // Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
 // Hint: Don't forget to round addr down.
@@ -89,20 +343,99 @@ flush_block(void *addr)
 
 	// LAB 5: Your code here.
     addr = ROUNDDOWN(addr, BLKSIZE);
-    if (!va_is_mapped(addr) || !va_is_dirty(addr))
+    if (!va_is_mapped(addr) || !va_is_dirty(addr) || journal_busy(blockno))
     {
         return;
     }
 
-    if ((r = ide_write(blockno * BLKSECTS, addr, BLKSECTS)) < 0)
+    if ((r = sys_page_map(thisenv->env_id, addr, thisenv->env_id, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
     {
-        panic("flush_block: ide_write failed: %e\n", r);
+        panic("flush_block: sys_page_map: %e\n", r);
     }
 
-    if ((r = sys_page_map(thisenv->env_id, addr, thisenv->env_id, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+    if ((r = ide_write(blockno * BLKSECTS, addr, BLKSECTS)) < 0)
     {
-        panic("flush_block: sys_page_map: %e\n", r);
+        panic("flush_block: ide_write failed: %e\n", r);
     }
+	fs_stats.fs_writes++;
+	fs_stats.fs_blocks_written++;
+}
+
+// Write back whichever of the 'n' blocks in 'blocknos' are cached,
+// dirty and not held back by the journal.  Sorts 'blocknos' in place,
+// then writes each run of adjacent blocks, up to BC_MAXRUN of them,
+// with a single ide_write.  As in flush_block, the dirty bits are
+// cleared first.
+void
+bc_flush_blocks(uint32_t *blocknos, int n)
+{
+	uint32_t b, gap;
+	int i, j, len, r;
+	void *va;
+
+	// Shell sort, then drop the blocks that need no writing.
+	for (gap = n / 2; gap > 0; gap /= 2)
+		for (i = gap; i < n; i++)
+			for (j = i - gap; j >= 0 && blocknos[j] > blocknos[j + gap]; j -= gap) {
+				b = blocknos[j];
+				blocknos[j] = blocknos[j + gap];
+				blocknos[j + gap] = b;
+			}
+	for (i = j = 0; i < n; i++) {
+		va = (void*) (DISKMAP + blocknos[i] * BLKSIZE);
+		if ((j == 0 || blocknos[i] != blocknos[j - 1])
+		    && va_is_mapped(va) && va_is_dirty(va)
+		    && !journal_busy(blocknos[i]))
+			blocknos[j++] = blocknos[i];
+	}
+	n = j;
+
+	for (i = 0; i < n; i += len) {
+		for (len = 1; i + len < n && len < BC_MAXRUN
+			     && blocknos[i + len] == blocknos[i] + len; len++)
+			/* do nothing */;
+		va = (void*) (DISKMAP + blocknos[i] * BLKSIZE);
+		for (j = 0; j < len; j++)
+			if ((r = sys_page_map(0, va + j * BLKSIZE, 0, va + j * BLKSIZE,
+					      uvpt[PGNUM(va + j * BLKSIZE)] & PTE_SYSCALL)) < 0)
+				panic("bc_flush_blocks: sys_page_map: %e\n", r);
+		if ((r = ide_write(blocknos[i] * BLKSECTS, va, len * BLKSECTS)) < 0)
+			panic("bc_flush_blocks: ide_write failed: %e\n", r);
+		fs_stats.fs_writes++;
+		fs_stats.fs_blocks_written += len;
+	}
+}
+
+// Write back every dirty block in the cache, then commit the journal.
+// The running transaction's blocks are held back, so they are written
+// once to the journal now and go home with the next sync, which is
+// when the blocks of earlier commits do.  Only resident blocks can be
+// dirty, so this scans the CLOCK ring rather than the whole disk.
+void
+bc_sync(void)
+{
+	static uint32_t dirty[BC_NBLOCKS];
+	uint32_t i, n;
+	void *va;
+
+	if (!journal_on())
+		bitmap_flush();
+
+	if (bc_untracked) {
+		for (i = 1; i < super->s_nblocks; i++)
+			flush_block((void*) (DISKMAP + i * BLKSIZE));
+		bc_untracked = 0;
+	}
+
+	for (i = n = 0; i < BC_NBLOCKS; i++) {
+		if (bc_ring[i] == 0 || bc_ring[i] == BC_RESERVED)
+			continue;
+		va = (void*) (DISKMAP + bc_ring[i] * BLKSIZE);
+		if (va_is_mapped(va) && va_is_dirty(va))
+			dirty[n++] = bc_ring[i];
+	}
+	bc_flush_blocks(dirty, n);
+	journal_commit();
 }
 
 // Test that the block cache works, by smashing the superblock and
@@ -139,6 +472,7 @@ void
 bc_init(void)
 {
 	struct Super super;
+	bc_prev_pgfault = _pgfault_handler;
 	set_pgfault_handler(bc_pgfault);
 	check_bc();
 
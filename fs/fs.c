@@ -17,13 +17,25 @@ check_super(void)
 	if (super->s_nblocks > DISKSIZE/BLKSIZE)
 		panic("file system is too large");
 
-	cprintf("superblock is good\n");
+	if (super->s_version > FS_VERSION)
+		panic("file system version %d is newer than %d",
+		      super->s_version, FS_VERSION);
+
+	cprintf("superblock is good (version %d)\n", super->s_version);
 }
 
 // --------------------------------------------------------------
 // Free block bitmap
 // --------------------------------------------------------------
 
+// Free blocks covered by each bitmap block, so that alloc_block can
+// skip full ones, and the word at which the last search succeeded.
+#define NBITMAP		(DISKSIZE / BLKSIZE / BLKBITSIZE)
+#define BITMAPWORDS	(BLKBITSIZE / 32)	// bitmap words per block
+
+static uint32_t bitmap_nfree[NBITMAP];
+static uint32_t alloc_cursor;
+
 // Check to see if the block bitmap indicates that block 'blockno' is free.
 // Return 1 if the block is free, 0 if not.
 bool
@@ -36,45 +48,175 @@ block_is_free(uint32_t blockno)
 	return 0;
 }
 
-// Mark a block free in the bitmap
+// Mark a block free in the bitmap.
+//
+// A client may still have the block's cache page mapped, through
+// FSREQ_MAP_BLOCKS or mmap.  The page is dropped from the cache, so
+// that whoever gets the block next gets a page of its own, and the
+// client's stale mapping can no longer see or change their data.
+// Blocks in the running transaction are metadata, which clients never
+// map, and must stay until it commits.
 void
 free_block(uint32_t blockno)
 {
+	void *va;
+
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
+	if (!(bitmap[blockno/32] & (1<<(blockno%32))))
+		bitmap_nfree[blockno / BLKBITSIZE]++;
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	journal_add(&bitmap[blockno/32]);
+
+	va = diskaddr(blockno);
+	if (va_is_mapped(va) && !journal_busy(blockno))
+		sys_page_unmap(0, va);
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Search the bitmap for a free block and allocate it.  'hint' is the
+// block the caller would like best, typically the one just after the
+// previous block of the same file, so that streaming writes are laid
+// out contiguously; 0 means no preference.  Otherwise the search
+// continues where the last one left off (next fit), a word at a time,
+// skipping bitmap blocks that have nothing free.
+//
+// The changed bitmap block is not flushed here: bitmap_flush writes
+// the bitmap back in one go, before file_flush or eviction writes the
+// metadata that points at the new blocks (see bc_flush_evicted).
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
 int
-alloc_block(void)
+alloc_block_near(uint32_t hint)
 {
 	// The bitmap consists of one or more blocks.  A single bitmap block
 	// contains the in-use bits for BLKBITSIZE blocks.  There are
 	// super->s_nblocks blocks in the disk altogether.
+	uint32_t nwords, n, w, skip, blockno;
+
+	if (hint == 0 || !block_is_free(hint)) {
+		nwords = (super->s_nblocks + 31) / 32;
+		w = alloc_cursor < nwords ? alloc_cursor : 0;
+		for (n = 0; n < nwords; n++, w = (w + 1) % nwords) {
+			// Skip the rest of a bitmap block with no free bits
+			if (bitmap_nfree[w / BITMAPWORDS] == 0) {
+				skip = MIN(BITMAPWORDS - 1 - w % BITMAPWORDS,
+					   nwords - 1 - w);
+				n += skip;
+				w += skip;
+				continue;
+			}
+			if (bitmap[w] == 0)
+				continue;
+			blockno = w * 32 + __builtin_ctz(bitmap[w]);
+			if (blockno < super->s_nblocks)
+				break;
+		}
+		if (n >= nwords)
+			return -E_NO_DISK;
+		alloc_cursor = w;
+		hint = blockno;
+	}
 
-	// LAB 5: Your code here.
-	uint32_t i = 0;
-    for (i = 0 ; i < super->s_nblocks ; i++)
-    {
-        if (block_is_free(i))
-        {
-            bitmap[i / 32] &= ~(1 << (i % 32));
-            flush_block(&bitmap[i / 32]);
+	bitmap[hint / 32] &= ~(1 << (hint % 32));
+	journal_add(&bitmap[hint / 32]);
+	bitmap_nfree[hint / BLKBITSIZE]--;
+	return hint;
+}
 
-            return i;
-        }
-    }
+int
+alloc_block(void)
+{
+	return alloc_block_near(0);
+}
+
+// Allocate up to 'n' adjacent blocks: the run of free blocks starting
+// at 'hint' if 'hint' is free, otherwise the first run of at least 'n'
+// free blocks on the disk, or failing that the longest one.  Sets
+// '*plen' to the number of blocks allocated.
+//
+// Return the first block allocated on success,
+// -E_NO_DISK if we are out of blocks.
+int
+alloc_extent(uint32_t hint, uint32_t n, uint32_t *plen)
+{
+	uint32_t b, start, run, best, len;
+
+	best = len = 0;
+	if (hint != 0 && block_is_free(hint)) {
+		best = hint;
+		for (len = 1; len < n && block_is_free(hint + len); len++)
+			/* do nothing */;
+	}
+
+	// Otherwise search the disk, a bitmap block or a word at a time
+	// where nothing or everything is free.
+	b = len ? super->s_nblocks : 0;
+	for (start = run = 0; len < n && b < super->s_nblocks; ) {
+		if (b % BLKBITSIZE == 0 && bitmap_nfree[b / BLKBITSIZE] == 0) {
+			run = 0;
+			b += BLKBITSIZE;
+			continue;
+		}
+		if (b % 32 == 0 && bitmap[b / 32] == 0) {
+			run = 0;
+			b += 32;
+			continue;
+		}
+		if (b % 32 == 0 && bitmap[b / 32] == ~0U && b + 32 <= super->s_nblocks) {
+			if (run == 0)
+				start = b;
+			run += 32;
+			b += 32;
+		} else if (block_is_free(b)) {
+			if (run++ == 0)
+				start = b;
+			b++;
+		} else {
+			run = 0;
+			b++;
+			continue;
+		}
+		if (run > len) {
+			best = start;
+			len = run;
+		}
+	}
+	if (len == 0)
+		return -E_NO_DISK;
+
+	*plen = len = MIN(len, n);
+	for (b = best; b < best + len; b++) {
+		bitmap[b / 32] &= ~(1 << (b % 32));
+		journal_add(&bitmap[b / 32]);
+		bitmap_nfree[b / BLKBITSIZE]--;
+	}
+	return best;
+}
+
+// Return the number of free blocks on the disk.
+static uint32_t
+nfree_blocks(void)
+{
+	uint32_t i, n = 0;
 
-	return -E_NO_DISK;
+	for (i = 0; i * BLKBITSIZE < super->s_nblocks; i++)
+		n += bitmap_nfree[i];
+	return n;
+}
+
+// Write back the dirty bitmap blocks.
+void
+bitmap_flush(void)
+{
+	uint32_t blocknos[NBITMAP];
+	int i, n;
+
+	n = (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+	for (i = 0; i < n; i++)
+		blocknos[i] = 2 + i;
+	bc_flush_blocks(blocknos, n);
 }
 
 // Validate the file system bitmap.
@@ -94,6 +236,14 @@ check_bitmap(void)
 	assert(!block_is_free(0));
 	assert(!block_is_free(1));
 
+	// Count the free blocks under each bitmap block for alloc_block.
+	memset(bitmap_nfree, 0, sizeof(bitmap_nfree));
+	for (i = 0; i < super->s_nblocks; i++)
+		if (bitmap[i / 32] == 0)
+			i += 31 - i % 32;
+		else if (block_is_free(i))
+			bitmap_nfree[i / BLKBITSIZE]++;
+
 	cprintf("bitmap is good\n");
 }
 
@@ -109,6 +259,8 @@ fs_init(void)
 {
 	static_assert(sizeof(struct File) == 256);
 
+       ide_init();
+
        // Find a JOS disk.  Use the second IDE disk (number 1) if availabl
        if (ide_probe_disk1())
                ide_set_disk(1);
@@ -119,6 +271,7 @@ fs_init(void)
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
 	check_super();
+	journal_init();
 
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
@@ -126,11 +279,52 @@ fs_init(void)
 	
 }
 
+// Return the number of blocks a File can address on this disk.
+// Version 0 images have no double-indirect block.
+static uint32_t
+file_max_blocks(void)
+{
+	if (super->s_version < 1)
+		return NDIRECT + NINDIRECT;
+	return MAXFILEBLOCKS;
+}
+
+// Return f's double-indirect block, or 0 if it has none.  On version 0
+// images f_dindirect is old padding, which may hold anything.
+static uint32_t
+file_dindirect(struct File *f)
+{
+	return super->s_version >= 1 ? f->f_dindirect : 0;
+}
+
+// Set '*pblk' to the block of pointers whose number is in '*pbno'.
+// If there is none yet and 'alloc' is set, allocate and clear one,
+// recording its number in '*pbno'.
+static int
+file_ptr_block(uint32_t *pbno, bool alloc, uint32_t **pblk)
+{
+	int r;
+
+	if (*pbno == 0) {
+		if (!alloc)
+			return -E_NOT_FOUND;
+		if ((r = alloc_block()) < 0)
+			return r;
+		*pbno = r;
+		memset(diskaddr(r), 0, BLKSIZE);
+		journal_add(pbno);
+		journal_add(diskaddr(r));
+	}
+	*pblk = bc_get(*pbno);
+	return 0;
+}
+
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
 // Set '*ppdiskbno' to point to that slot.
 // The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
+// an entry in the indirect block, or an entry in one of the blocks
+// the double-indirect block points to.
+// When 'alloc' is set, this function will allocate indirect blocks
 // if necessary.
 //
 // Returns:
@@ -138,7 +332,7 @@ fs_init(void)
 //	-E_NOT_FOUND if the function needed to allocate an indirect block, but
 //		alloc was 0.
 //	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_INVAL if filebno is out of range (it's >= file_max_blocks()).
 //
 // Analogy: This is like pgdir_walk for files.
 // Hint: Don't forget to clear any block you allocate.
@@ -146,12 +340,15 @@ static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
        // LAB 5: Your code here.
+       int r;
+       uint32_t *indirect_addr;
+
        if (f == NULL)
        {
            panic("file_block_walk: null struct File\n");
        }
 
-       if (filebno >= NDIRECT + NINDIRECT)
+       if (filebno >= file_max_blocks())
        {
            return -E_INVAL;
        }
@@ -162,35 +359,273 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
            return 0;
        }
 
-       if (f->f_indirect == 0 && !alloc)
+       filebno -= NDIRECT;
+       if (filebno < NINDIRECT)
        {
-           return -E_NOT_FOUND;
+           if ((r = file_ptr_block(&f->f_indirect, alloc, &indirect_addr)) < 0)
+           {
+               return r;
+           }
+           *ppdiskbno = &indirect_addr[filebno];
+           return 0;
        }
 
-       if (f->f_indirect == 0 && alloc)
+       // Two levels: the double-indirect block holds the numbers of
+       // NINDIRECT ordinary indirect blocks.
+       filebno -= NINDIRECT;
+       if ((r = file_ptr_block(&f->f_dindirect, alloc, &indirect_addr)) < 0 ||
+           (r = file_ptr_block(&indirect_addr[filebno / NINDIRECT], alloc,
+                               &indirect_addr)) < 0)
        {
-           int new_block = alloc_block();
-           if (new_block < 0)
-           {
-               return -E_NO_DISK;
-           }
-           f->f_indirect = new_block;
-           // indirect_addr = diskaddr(new_block);
-           memset(diskaddr(f->f_indirect), 0, BLKSIZE);
+           return r;
        }
+       *ppdiskbno = &indirect_addr[filebno % NINDIRECT];
 
-       uint32_t* indirect_addr = diskaddr(f->f_indirect);
+       return 0;
+}
 
-       uint32_t updated_filebno = filebno - NDIRECT;
-       *ppdiskbno = &indirect_addr[updated_filebno];
+// --------------------------------------------------------------
+// Delayed allocation
+// --------------------------------------------------------------
 
-       return 0;
+// file_write does not give a block that a file does not have yet a
+// disk block at once.  The data goes to a page of its own here, and
+// file_alloc_delayed allocates the disk blocks later, when the file is
+// flushed or the background write-back runs, as few extents as the
+// disk allows for each file.  A file written front to back thus ends up
+// contiguous on disk, and its bitmap and pointer blocks change once per
+// write-back rather than once per block.
+//
+// Delayed block i is kept at DELAYVA + i * BLKSIZE.  The free blocks
+// they will need are held back from new delayed blocks, so that
+// allocating them later does not run out of disk.  Besides the blocks
+// themselves, that is the pointer blocks their files do not have yet:
+// one delayed block of each file reserves each missing pointer block.
+#define NDELAY		256
+
+#define DELAY_PTR	0x1	// reserves the pointer block it hangs off
+#define DELAY_DIND	0x2	// reserves the double-indirect block
+
+struct Delayed {
+	struct File *d_file;	// owner, NULL if the entry is free
+	uint32_t d_filebno;	// block of d_file it stands for
+	uint32_t d_ptrs;	// pointer blocks reserved (DELAY_*)
+};
+
+static struct Delayed delayed[NDELAY];
+static uint32_t ndelayed;
+static uint32_t delay_nptrs;	// pointer blocks reserved
+
+static char *
+delay_va(struct Delayed *d)
+{
+	return (char*) (DELAYVA + (d - delayed) * BLKSIZE);
 }
 
+// The pointer block that file block 'filebno' hangs off: 0 for none,
+// 1 for f_indirect, and 2 + i for block i under f_dindirect.
+static uint32_t
+delay_range(uint32_t filebno)
+{
+	if (filebno < NDIRECT)
+		return 0;
+	if (filebno < NDIRECT + NINDIRECT)
+		return 1;
+	return 2 + (filebno - NDIRECT - NINDIRECT) / NINDIRECT;
+}
 
+// Reserve the pointer blocks that d's file lacks for d, unless another
+// of its delayed blocks has reserved them.
+static void
+delay_reserve(struct Delayed *d)
+{
+	struct File *f = d->d_file;
+	struct Delayed *e;
+	uint32_t range, ptrs, *dind;
+
+	range = delay_range(d->d_filebno);
+	ptrs = 0;
+	if (range == 1 && f->f_indirect == 0)
+		ptrs = DELAY_PTR;
+	if (range >= 2 && file_dindirect(f) == 0)
+		ptrs = DELAY_PTR | DELAY_DIND;
+	else if (range >= 2) {
+		dind = bc_get(f->f_dindirect);
+		if (dind[range - 2] == 0)
+			ptrs = DELAY_PTR;
+	}
+	for (e = delayed; e < delayed + NDELAY && ptrs; e++) {
+		if (e == d || e->d_file != f)
+			continue;
+		if (delay_range(e->d_filebno) == range)
+			ptrs &= ~(e->d_ptrs & DELAY_PTR);
+		ptrs &= ~(e->d_ptrs & DELAY_DIND);
+	}
+	d->d_ptrs = ptrs;
+	delay_nptrs += !!(ptrs & DELAY_PTR) + !!(ptrs & DELAY_DIND);
+}
+
+// Give back the pointer blocks d reserved.
+static void
+delay_unreserve(struct Delayed *d)
+{
+	delay_nptrs -= !!(d->d_ptrs & DELAY_PTR) + !!(d->d_ptrs & DELAY_DIND);
+	d->d_ptrs = 0;
+}
 
+// Find block 'filebno' of 'f' among the delayed blocks.
+static struct Delayed *
+delay_find(struct File *f, uint32_t filebno)
+{
+	struct Delayed *d;
+
+	if (ndelayed == 0)
+		return NULL;
+	for (d = delayed; d < delayed + NDELAY; d++)
+		if (d->d_file == f && d->d_filebno == filebno)
+			return d;
+	return NULL;
+}
 
+// Forget delayed block d.  If it held reservations for its file, the
+// file's other delayed blocks take over what they still need.
+static void
+delay_free(struct Delayed *d)
+{
+	struct File *f = d->d_file;
+	struct Delayed *e;
+	bool reserved = d->d_ptrs != 0;
+	int r;
 
+	if ((r = sys_page_unmap(0, delay_va(d))) < 0)
+		panic("delay_free: sys_page_unmap: %e", r);
+	delay_unreserve(d);
+	d->d_file = NULL;
+	ndelayed--;
+
+	if (!reserved)
+		return;
+	for (e = delayed; e < delayed + NDELAY; e++)
+		if (e->d_file == f)
+			delay_unreserve(e);
+	for (e = delayed; e < delayed + NDELAY; e++)
+		if (e->d_file == f)
+			delay_reserve(e);
+}
+
+// Give the delayed blocks of 'f', or of every file if 'f' is NULL,
+// their disk blocks.  Each file's blocks are allocated in file order,
+// continuing after the block before the first of them if that is free,
+// so adjacent file blocks get adjacent disk blocks.
+//
+// Returns 0 on success, < 0 on error.
+static int
+file_alloc_delayed(struct File *f)
+{
+	// Static: too big for a request thread's stack, and only a
+	// writer or the write-back gets here, one at a time
+	static struct Delayed *run[NDELAY];
+	struct Delayed *d, *t;
+	struct File *g;
+	uint32_t i, j, n, len, hint, *pdiskbno;
+	int r, b;
+
+	while (ndelayed > 0) {
+		// Collect the next file's blocks and sort them
+		g = f;
+		for (d = delayed, n = 0; d < delayed + NDELAY; d++) {
+			if (!d->d_file || (g && d->d_file != g))
+				continue;
+			g = d->d_file;
+			for (i = n++; i > 0 && run[i - 1]->d_filebno > d->d_filebno; i--)
+				run[i] = run[i - 1];
+			run[i] = d;
+		}
+		if (n == 0)
+			return 0;
+
+		for (i = 0; i < n; i += len) {
+			// Between extents every allocated block is pointed to
+			journal_begin(JOURNAL_OPBLOCKS);
+			hint = 0;
+			if (run[i]->d_filebno > 0
+			    && file_block_walk(g, run[i]->d_filebno - 1, &pdiskbno, 0) == 0
+			    && *pdiskbno != 0)
+				hint = *pdiskbno + 1;
+			if ((b = alloc_extent(hint, n - i, &len)) < 0)
+				return b;
+			fs_stats.fs_extents++;
+			fs_stats.fs_blocks_delayed += len;
+
+			// The block goes into the cache before the file points
+			// to it, as a reader may look for it meanwhile.
+			for (j = 0; j < len; j++) {
+				t = run[i + j];
+				if ((r = file_block_walk(g, t->d_filebno, &pdiskbno, 1)) < 0) {
+					// The rest of the extent stays free
+					for (; j < len; j++)
+						free_block(b + j);
+					return r;
+				}
+				bc_insert(b + j, delay_va(t));
+				*pdiskbno = b + j;
+				delay_free(t);
+				journal_add(pdiskbno);
+			}
+		}
+	}
+	return 0;
+}
+
+// Set *blk to the delayed block standing for block 'filebno' of 'f',
+// starting one (which reads as zeros) if there is none.
+static int
+delay_block(struct File *f, uint32_t filebno, char **blk)
+{
+	struct Delayed *d;
+	int r;
+
+	if ((d = delay_find(f, filebno)) != NULL) {
+		*blk = delay_va(d);
+		return 0;
+	}
+	if (ndelayed == NDELAY && (r = file_alloc_delayed(NULL)) < 0)
+		return r;
+
+	for (d = delayed; d->d_file; d++)
+		/* do nothing */;
+	d->d_file = f;
+	d->d_filebno = filebno;
+	delay_reserve(d);
+	// Leave room for the delayed blocks and the pointer blocks
+	// they need
+	if (nfree_blocks() < ndelayed + 1 + delay_nptrs) {
+		delay_unreserve(d);
+		d->d_file = NULL;
+		return -E_NO_DISK;
+	}
+	if ((r = sys_page_alloc(0, delay_va(d), PTE_P|PTE_W|PTE_U)) < 0) {
+		delay_unreserve(d);
+		d->d_file = NULL;
+		return r;
+	}
+	ndelayed++;
+	*blk = delay_va(d);
+	return 0;
+}
+
+// Forget the delayed blocks of 'f' at or past block 'filebno'.
+static void
+delay_truncate(struct File *f, uint32_t filebno)
+{
+	struct Delayed *d;
+
+	if (ndelayed == 0)
+		return;
+	for (d = delayed; d < delayed + NDELAY; d++)
+		if (d->d_file == f && d->d_filebno >= filebno)
+			delay_free(d);
+}
 
 // Set *blk to the address in memory where the filebno'th
 // block of file 'f' would be mapped.
@@ -206,11 +641,17 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
     int r;
     uint32_t* ppdiskbno;
        // LAB 5: Your code here.
-    if (filebno >= NDIRECT + NINDIRECT)
+    if (filebno >= file_max_blocks())
     {
         return -E_INVAL;
     }
 
+    // Callers want a real disk block, so a delayed one gets it now
+    if (delay_find(f, filebno) && (r = file_alloc_delayed(f)) < 0)
+    {
+        return r;
+    }
+
     if ((r = file_block_walk(f, filebno, &ppdiskbno, true)) < 0)
     {
         return r;
@@ -218,19 +659,154 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 
     if (*ppdiskbno == 0)
     {
-        int new_block = alloc_block();
+        // Place the block right after the file's previous one if we can
+        uint32_t *pprev, hint = 0;
+        if (filebno > 0 && file_block_walk(f, filebno - 1, &pprev, false) == 0
+            && *pprev != 0)
+            hint = *pprev + 1;
+        int new_block = alloc_block_near(hint);
         if (new_block < 0)
         {
             return new_block;
         }
         *ppdiskbno = new_block;
+        journal_add(ppdiskbno);
     }
 
-    *blk = diskaddr(*ppdiskbno);
+    *blk = bc_get(*ppdiskbno);
 
     return 0;
 }
 
+// Like file_get_block, but for reading: a block the file does not
+// have yet is a hole, which reads as zeros, so rather than allocating
+// it set *blk to NULL.  A delayed block is returned as it is.
+//
+// Returns 0 on success, < 0 on error.
+int
+file_find_block(struct File *f, uint32_t filebno, char **blk)
+{
+	struct Delayed *d;
+	uint32_t *pdiskbno;
+	int r;
+
+	// A missing indirect block just means a bigger hole
+	r = file_block_walk(f, filebno, &pdiskbno, 0);
+	if (r == -E_NOT_FOUND || (r == 0 && *pdiskbno == 0)) {
+		d = delay_find(f, filebno);
+		*blk = d ? delay_va(d) : NULL;
+		return 0;
+	}
+	if (r < 0)
+		return r;
+	*blk = bc_get(*pdiskbno);
+	return 0;
+}
+
+
+// Directories smaller than this are scanned rather than indexed.
+#define DIRHASH_MINBLOCKS	2
+
+// Hash a file name into a DirIndex bucket (FNV-1a).
+static uint32_t
+dir_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h % DIRHASH_NBUCKET;
+}
+
+// Set *file to entry number 'ent' of dir.
+static int
+dir_entry(struct File *dir, uint32_t ent, struct File **file)
+{
+	int r;
+	char *blk;
+
+	if ((r = file_get_block(dir, ent / BLKFILES, &blk)) < 0)
+		return r;
+	*file = (struct File*) blk + ent % BLKFILES;
+	return 0;
+}
+
+// Return dir's index block, or 0 if it has none.  Before version 2
+// f_dirindex is old padding, which may hold anything.
+static uint32_t
+file_dirindex(struct File *dir)
+{
+	return super->s_version >= 2 ? dir->f_dirindex : 0;
+}
+
+// Return dir's hash index.  If it has none and 'build' is set, build
+// it with one linear scan; only file creation does that, so lookups
+// never allocate or dirty anything.  Returns NULL if dir should just
+// be scanned: it is small, the image predates indexes, there is no
+// disk space, or it has no index and 'build' is clear.
+//
+// A big directory has more blocks than a transaction, so the index is
+// built in memory and the journal may commit between directory blocks:
+// f_hnext means nothing until dir->f_dirindex is set, at the end.
+static struct DirIndex *
+dir_index(struct File *dir, bool build)
+{
+	// Static: a block is too big for a request thread's stack, and
+	// only a writer gets here
+	static struct DirIndex build_di;
+	int r;
+	uint32_t ent, *chain;
+	struct DirIndex *di;
+	struct File *f;
+
+	if (super->s_version < 2)
+		return NULL;
+	if (dir->f_dirindex)
+		return bc_get(dir->f_dirindex);
+	if (!build || dir->f_size < DIRHASH_MINBLOCKS * BLKSIZE)
+		return NULL;
+
+	memset(&build_di, 0, sizeof(build_di));
+	// Go backwards so the free chain hands out low entries first
+	for (ent = dir->f_size / BLKSIZE * BLKFILES; ent-- > 0; ) {
+		if (ent % BLKFILES == BLKFILES - 1)
+			journal_begin(JOURNAL_OPBLOCKS);
+		if (dir_entry(dir, ent, &f) < 0)
+			return NULL;
+		chain = f->f_name[0] ? &build_di.di_bucket[dir_hash(f->f_name)]
+				     : &build_di.di_free;
+		f->f_hnext = *chain;
+		*chain = ent + 1;
+		journal_add(f);
+	}
+
+	if ((r = alloc_block()) < 0)
+		return NULL;
+	di = diskaddr(r);
+	memmove(di, &build_di, BLKSIZE);
+	journal_add(di);
+	dir->f_dirindex = r;
+	journal_add(dir);
+	return di;
+}
+
+// Add entry 'ent' of dir, which now holds f's name, to dir's index.
+static void
+dir_link(struct File *dir, struct File *f, uint32_t ent)
+{
+	struct DirIndex *di;
+	uint32_t *chain;
+
+	// An index built after f was named already has it
+	if (file_dirindex(dir) == 0)
+		return;
+	di = bc_get(dir->f_dirindex);
+	chain = &di->di_bucket[dir_hash(f->f_name)];
+	f->f_hnext = *chain;
+	*chain = ent + 1;
+	journal_add(f);
+	journal_add(di);
+}
 
 // Try to find a file named "name" in dir.  If so, set *file to it.
 //
@@ -240,14 +816,28 @@ static int
 dir_lookup(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t i, j, nblock;
+	uint32_t i, j, nblock, ent;
 	char *blk;
 	struct File *f;
+	struct DirIndex *di;
 
 	// Search dir for name.
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
+
+	if ((di = dir_index(dir, 0)) != NULL) {
+		for (ent = di->di_bucket[dir_hash(name)]; ent; ent = f->f_hnext) {
+			if ((r = dir_entry(dir, ent - 1, &f)) < 0)
+				return r;
+			if (strcmp(f->f_name, name) == 0) {
+				*file = f;
+				return 0;
+			}
+		}
+		return -E_NOT_FOUND;
+	}
+
 	nblock = dir->f_size / BLKSIZE;
 	for (i = 0; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
@@ -262,18 +852,43 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, and *pent to its
+// entry number.  The caller is responsible for filling in the File
+// fields and then calling dir_link.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, struct File **file, uint32_t *pent)
 {
 	int r;
 	uint32_t nblock, i, j;
 	char *blk;
 	struct File *f;
+	struct DirIndex *di;
 
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
+
+	if ((di = dir_index(dir, 1)) != NULL) {
+		if (di->di_free == 0) {
+			dir->f_size += BLKSIZE;
+			journal_add(dir);
+			if ((r = file_get_block(dir, nblock, &blk)) < 0)
+				return r;
+			memset(blk, 0, BLKSIZE);
+			journal_add(blk);
+			f = (struct File*) blk;
+			for (j = BLKFILES; j-- > 0; ) {
+				f[j].f_hnext = di->di_free;
+				di->di_free = nblock * BLKFILES + j + 1;
+			}
+		}
+		*pent = di->di_free - 1;
+		if ((r = dir_entry(dir, *pent, file)) < 0)
+			return r;
+		di->di_free = (*file)->f_hnext;
+		journal_add(di);
+		return 0;
+	}
+
 	for (i = 0; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
@@ -281,17 +896,91 @@ dir_alloc_file(struct File *dir, struct File **file)
 		for (j = 0; j < BLKFILES; j++)
 			if (f[j].f_name[0] == '\0') {
 				*file = &f[j];
+				*pent = i * BLKFILES + j;
 				return 0;
 			}
 	}
 	dir->f_size += BLKSIZE;
+	journal_add(dir);
 	if ((r = file_get_block(dir, i, &blk)) < 0)
 		return r;
+	// A freshly allocated block may hold stale names
+	memset(blk, 0, BLKSIZE);
+	journal_add(blk);
 	f = (struct File*) blk;
 	*file = &f[0];
+	*pent = i * BLKFILES;
 	return 0;
 }
 
+// --------------------------------------------------------------
+// Name cache
+// --------------------------------------------------------------
+
+// Recent (directory, name) lookups and their results, so hot paths
+// skip dir_lookup.  A NULL nc_file remembers that the name is absent.
+// Both pointers are into the block cache, whose addresses never move.
+struct NameCache {
+	struct File *nc_dir;
+	struct File *nc_file;
+	char nc_name[MAXNAMELEN];
+};
+
+static struct NameCache namecache[NAMECACHE];
+
+static struct NameCache *
+namecache_slot(struct File *dir, const char *name)
+{
+	uint32_t h = dir_hash(name) ^ ((uint32_t) dir / sizeof(struct File));
+
+	return &namecache[h % NAMECACHE];
+}
+
+// Remember that 'name' in dir is f (NULL if there is no such file).
+static void
+namecache_enter(struct File *dir, const char *name, struct File *f)
+{
+	struct NameCache *nc = namecache_slot(dir, name);
+
+	nc->nc_dir = dir;
+	nc->nc_file = f;
+	strcpy(nc->nc_name, name);
+}
+
+// Forget anything cached for 'name' in dir.
+static void
+namecache_forget(struct File *dir, const char *name)
+{
+	struct NameCache *nc = namecache_slot(dir, name);
+
+	if (nc->nc_dir == dir && strcmp(nc->nc_name, name) == 0)
+		nc->nc_dir = NULL;
+}
+
+// dir_lookup, going through the name cache.
+static int
+dir_lookup_cached(struct File *dir, const char *name, struct File **file)
+{
+	int r;
+	struct NameCache *nc = namecache_slot(dir, name);
+
+	if (nc->nc_dir == dir && strcmp(nc->nc_name, name) == 0) {
+		fs_stats.fs_name_hits++;
+		if (nc->nc_file == NULL)
+			return -E_NOT_FOUND;
+		*file = nc->nc_file;
+		return 0;
+	}
+
+	fs_stats.fs_name_misses++;
+	r = dir_lookup(dir, name, file);
+	if (r == 0)
+		namecache_enter(dir, name, *file);
+	else if (r == -E_NOT_FOUND)
+		namecache_enter(dir, name, NULL);
+	return r;
+}
+
 // Skip over slashes.
 static const char*
 skip_slash(const char *p)
@@ -339,7 +1028,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if ((r = dir_lookup_cached(dir, name, &f)) < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -368,16 +1057,22 @@ file_create(const char *path, struct File **pf)
 {
 	char name[MAXNAMELEN];
 	int r;
+	uint32_t ent;
 	struct File *dir, *f;
 
 	if ((r = walk_path(path, &dir, &f, name)) == 0)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	namecache_forget(dir, name);
+	if ((r = dir_alloc_file(dir, &f, &ent)) < 0)
 		return r;
 
+	// Unused slots are not guaranteed to be clean
+	memset(f, 0, sizeof(struct File));
 	strcpy(f->f_name, name);
+	journal_add(f);
+	dir_link(dir, f, ent);
 	*pf = f;
 	file_flush(dir);
 	return 0;
@@ -393,6 +1088,7 @@ file_open(const char *path, struct File **pf)
 
 // Read count bytes from f into buf, starting from seek position
 // offset.  This meant to mimic the standard pread function.
+// Holes read as zeros, and stay holes.
 // Returns the number of bytes read, < 0 on error.
 ssize_t
 file_read(struct File *f, void *buf, size_t count, off_t offset)
@@ -407,10 +1103,13 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	count = MIN(count, f->f_size - offset);
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((r = file_find_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
-		memmove(buf, blk + pos % BLKSIZE, bn);
+		if (blk)
+			memmove(buf, blk + pos % BLKSIZE, bn);
+		else
+			memset(buf, 0, bn);
 		pos += bn;
 		buf += bn;
 	}
@@ -421,7 +1120,8 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
-// Extends the file if necessary.
+// Extends the file if necessary.  Blocks the file does not have yet
+// are delayed: see file_alloc_delayed.
 // Returns the number of bytes written, < 0 on error.
 int
 file_write(struct File *f, const void *buf, size_t count, off_t offset)
@@ -436,7 +1136,8 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 			return r;
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((r = file_find_block(f, pos / BLKSIZE, &blk)) < 0
+		    || (!blk && (r = delay_block(f, pos / BLKSIZE, &blk)) < 0))
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
 		memmove(blk + pos % BLKSIZE, buf, bn);
@@ -447,21 +1148,33 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	return count;
 }
 
-// Remove a block from file f.  If it's not there, just silently succeed.
-// Returns 0 on success, < 0 on error.
-static int
-file_free_block(struct File *f, uint32_t filebno)
+// Free the blocks that entries 'from' and up of the indirect block
+// numbered '*pbno' point to, and that block itself if 'from' is 0.
+// Entries are only cleared in a block that stays: one being freed
+// whole is left as it is, so that truncating a big file changes the
+// bitmap and a few pointer blocks, which fit in one transaction.
+static void
+file_free_ptrs(uint32_t *pbno, uint32_t from)
 {
-	int r;
-	uint32_t *ptr;
+	uint32_t i, *ptrs;
 
-	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
-		return r;
-	if (*ptr) {
-		free_block(*ptr);
-		*ptr = 0;
+	if (*pbno == 0)
+		return;
+	ptrs = bc_get(*pbno);
+	for (i = from; i < NINDIRECT; i++) {
+		if (ptrs[i] == 0)
+			continue;
+		free_block(ptrs[i]);
+		if (from > 0) {
+			ptrs[i] = 0;
+			journal_add(ptrs);
+		}
+	}
+	if (from == 0) {
+		free_block(*pbno);
+		*pbno = 0;
+		journal_add(pbno);
 	}
-	return 0;
 }
 
 // Remove any blocks currently used by file 'f',
@@ -471,65 +1184,184 @@ file_free_block(struct File *f, uint32_t filebno)
 // If the new_nblocks is no more than NDIRECT, and the indirect block has
 // been allocated (f->f_indirect != 0), then free the indirect block too.
 // (Remember to clear the f->f_indirect pointer so you'll know
-// whether it's valid!)
+// whether it's valid!)  Likewise free the indirect blocks under the
+// double-indirect block that no longer cover any of the file, and the
+// double-indirect block itself once nothing is left beyond f_indirect.
 // Do not change f->f_size.
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
-	int r;
-	uint32_t bno, old_nblocks, new_nblocks;
+	uint32_t bno, new_nblocks, first, i, *dind;
 
-	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
-	for (bno = new_nblocks; bno < old_nblocks; bno++)
-		if ((r = file_free_block(f, bno)) < 0)
-			cprintf("warning: file_free_block: %e", r);
+	// The whole truncation is one update: every bitmap block, f,
+	// and at most f_indirect, f_dindirect and one block under it
+	journal_begin(NBITMAP + 4);
+	delay_truncate(f, new_nblocks);
+	for (bno = new_nblocks; bno < NDIRECT; bno++)
+		if (f->f_direct[bno]) {
+			free_block(f->f_direct[bno]);
+			f->f_direct[bno] = 0;
+			journal_add(f);
+		}
 
-	if (new_nblocks <= NDIRECT && f->f_indirect) {
-		free_block(f->f_indirect);
-		f->f_indirect = 0;
+	// A missing indirect block just means a hole
+	file_free_ptrs(&f->f_indirect, new_nblocks > NDIRECT
+		       ? MIN(new_nblocks - NDIRECT, NINDIRECT) : 0);
+
+	if (file_dindirect(f)) {
+		dind = bc_get(f->f_dindirect);
+		// First block under the double-indirect block to free
+		first = 0;
+		if (new_nblocks > NDIRECT + NINDIRECT)
+			first = new_nblocks - NDIRECT - NINDIRECT;
+		for (i = first / NINDIRECT; i < NINDIRECT; i++)
+			file_free_ptrs(&dind[i], i == first / NINDIRECT
+				       ? first % NINDIRECT : 0);
+		if (first == 0) {
+			free_block(f->f_dindirect);
+			f->f_dindirect = 0;
+			journal_add(f);
+		}
 	}
 }
 
 // Set the size of file f, truncating or extending as necessary.
+// Extending allocates nothing: the new part of the file is a hole
+// until it is written.  Nor does it write f back, which the next
+// flush or background write-back does; a shrunk f is written back at
+// once, before its freed blocks can go to another file.
 int
 file_set_size(struct File *f, off_t newsize)
 {
-	if (f->f_size > newsize)
+	char *blk;
+	bool shrink;
+
+	if (f->f_size > newsize) {
 		file_truncate_blocks(f, newsize);
+		// Clear the rest of the new last block, which would
+		// otherwise show through if the file grew again.
+		if (newsize % BLKSIZE != 0
+		    && file_find_block(f, newsize / BLKSIZE, &blk) == 0 && blk)
+			memset(blk + newsize % BLKSIZE, 0,
+			       BLKSIZE - newsize % BLKSIZE);
+	}
+	// With a journal, f waits for the next commit instead
+	shrink = newsize < f->f_size;
 	f->f_size = newsize;
-	flush_block(f);
+	journal_add(f);
+	if (shrink)
+		flush_block(f);
 	return 0;
 }
 
+// File generations, which whoever caches a file's contents (such as
+// spawn's zygotes) compares to tell that the file may have changed.
+// They are kept only in memory: nothing that caches a file outlives
+// the file server.  A File's place in the block cache never moves, so
+// it picks the counter; files that share one just see spurious changes.
+static uint32_t file_gens[NFILEGEN];
+static uint32_t file_gen_clock;
+
+static uint32_t *
+file_gen_slot(struct File *f)
+{
+	return &file_gens[((uintptr_t) f / sizeof(struct File)) % NFILEGEN];
+}
+
+// Note that f is about to change: give it a generation number no file
+// has had before.
+void
+file_touch(struct File *f)
+{
+	*file_gen_slot(f) = ++file_gen_clock;
+}
+
+// f's generation.
+uint32_t
+file_gen(struct File *f)
+{
+	return *file_gen_slot(f);
+}
+
 // Flush the contents and metadata of file f out to disk.
 // Loop over all the blocks in file.
 // Translate the file block number into a disk block number
 // and then check whether that disk block is dirty.  If so, write it out.
-void
+// The dirty blocks are collected and written by bc_flush_blocks, which
+// merges adjacent ones into a single disk write.
+//
+// With a journal only the data blocks are written here; committing
+// the transaction then makes f's metadata durable, and it goes home
+// with the next background sync.
+//
+// Returns 0 on success, or the error that kept some delayed block
+// from getting a disk block; everything else is flushed anyway.
+int
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
+	int i, n, r;
+	uint32_t *pdiskbno, *dind, blocknos[2 * BC_MAXRUN];
 
+	r = file_alloc_delayed(f);
+
+	// Blocks the file uses must be marked in use on disk before
+	// anything that points to them is written.  The journal commits
+	// the bitmap along with the rest.
+	if (!journal_on())
+		bitmap_flush();
+
+	n = 0;
 	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
 		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
 		    pdiskbno == NULL || *pdiskbno == 0)
 			continue;
-		flush_block(diskaddr(*pdiskbno));
+		blocknos[n++] = *pdiskbno;
+		if (n == sizeof(blocknos) / sizeof(blocknos[0])) {
+			bc_flush_blocks(blocknos, n);
+			n = 0;
+		}
+	}
+	if (file_dindirect(f)) {
+		dind = bc_get(f->f_dindirect);
+		for (i = 0; i < NINDIRECT; i++) {
+			if (dind[i] == 0)
+				continue;
+			blocknos[n++] = dind[i];
+			if (n == sizeof(blocknos) / sizeof(blocknos[0])) {
+				bc_flush_blocks(blocknos, n);
+				n = 0;
+			}
+		}
+		blocknos[n++] = f->f_dindirect;
+	}
+	bc_flush_blocks(blocknos, n);
+	// The data is home, so the metadata pointing to it may commit
+	if (journal_on()) {
+		journal_commit();
+		return r;
 	}
 	flush_block(f);
 	if (f->f_indirect)
 		flush_block(diskaddr(f->f_indirect));
+	if (file_dirindex(f))
+		flush_block(diskaddr(f->f_dirindex));
+	return r;
 }
 
 
-// Sync the entire file system.  A big hammer.
-void
+// Sync the entire file system.  Only cached blocks can be dirty,
+// so this costs in proportion to the cache, not the disk.
+// Delayed blocks are allocated first, which puts them in the cache.
+// Returns 0 on success, or the error that kept some delayed block from
+// getting a disk block.
+int
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	int r;
+
+	r = file_alloc_delayed(NULL);
+	bc_sync();
+	return r;
 }
 
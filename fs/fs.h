@@ -3,6 +3,7 @@
 
 #define SECTSIZE	512			// bytes per disk sector
 #define BLKSECTS	(BLKSIZE / SECTSIZE)	// sectors per block
+#define BC_MAXRUN	(256 / BLKSECTS)	// blocks per IDE command
 
 /* Disk block n, when in memory, is mapped into the file system
  * server's address space at DISKMAP + (n*BLKSIZE). */
@@ -11,38 +12,139 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Most disk blocks the block cache keeps mapped at once (16MB) */
+#define BC_NBLOCKS	4096
+
+/* Path components the name cache remembers */
+#define NAMECACHE	256
+
+/* Generation counters that files share (see file_gen) */
+#define NFILEGEN	1024
+
+/* How often dirty blocks are written back in the background */
+#define BC_FLUSH_MSEC	1000
+
+/* Fixed regions of the file server's address space.  They sit between
+ * the program and the malloc heap, which takes [0x08000000, DISKMAP),
+ * one PTSIZE slot each. */
+#define REQVA		0x04000000	/* client request pages (serv.c) */
+#define IDE_SHAREDVA	0x04400000	/* struct IdeShared (ide.c) */
+#define VIO_QVA		0x04800000	/* virtio-blk queue (virtio.c) */
+#define VIO_SCRATCHVA	0x04C00000	/* virtio_contig's scratch pages */
+#define BC_LOADVA	0x05000000	/* block cache reads (bc.c) */
+#define DELAYVA		0x05400000	/* delayed blocks (fs.c) */
+#define WINDOWVA	0x05800000	/* clients' bulk I/O windows (serv.c) */
+#define AIOVA		0x05C00000	/* clients' aio regions (serv.c) */
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
 
+/* pci.c */
+#define PCI_TAG(bus, dev, func)	(((bus) << 16) | ((dev) << 11) | ((func) << 8))
+#define PCI_COMMAND_STATUS_REG	0x04
+#define PCI_COMMAND_IO_ENABLE	0x00000001
+#define PCI_COMMAND_MEM_ENABLE	0x00000002
+#define PCI_COMMAND_MASTER_ENABLE	0x00000004
+#define PCI_BAR(n)		(0x10 + 4 * (n))
+#define PCI_CLASS(class)	(((class) >> 24) & 0xFF)
+#define PCI_SUBCLASS(class)	(((class) >> 16) & 0xFF)
+
+uint32_t pci_conf_read(uint32_t tag, uint32_t reg);
+void	pci_conf_write(uint32_t tag, uint32_t reg, uint32_t v);
+int	pci_find(bool (*match)(uint32_t id, uint32_t class), uint32_t *tag);
+
 /* ide.c */
+// The IDE driver state that the file server shares with its timer env,
+// so that the timer can watch DMA transfers while the server sleeps.
+struct IdeShared {
+	uint16_t is_bmide;		// bus-master base port, 0 if PIO only
+	volatile uint32_t is_busy;	// a DMA transfer is in flight
+	volatile uint32_t is_seq;	// DMA transfers started
+	uint16_t is_vioport;		// virtio-blk base port, 0 if none
+	volatile uint16_t is_vio_seen;	// used ring entries taken
+	volatile uint16_t *is_vio_used;	// virtio-blk used ring index
+};
+extern struct IdeShared *ide_shared;
+
+void	ide_share(void);
+void	ide_init(void);
+bool	ide_dma_ended(void);
+uint32_t ide_dma_seq(void);
+void	ide_poll(void);
 bool	ide_probe_disk1(void);
 void	ide_set_disk(int diskno);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
 
+/* virtio.c */
+int	virtio_init(void);
+void	virtio_poll(void);
+int	virtio_rw(uint32_t secno, const void *buf, size_t nsecs, bool to_mem);
+
 /* bc.c */
+extern struct FsStats fs_stats;
+extern bool bc_faulting;
 void*	diskaddr(uint32_t blockno);
+void*	bc_get(uint32_t blockno);
+void	bc_insert(uint32_t blockno, void *pg);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	bc_flush_blocks(uint32_t *blocknos, int n);
+void	bc_sync(void);
 void	bc_init(void);
 
+/* journal.c */
+// Most metadata blocks one file system request changes; each request
+// that may write starts with journal_begin(JOURNAL_OPBLOCKS).
+#define JOURNAL_OPBLOCKS	16
+
+bool	journal_on(void);
+bool	journal_busy(uint32_t blockno);
+void	journal_begin(uint32_t n);
+void	journal_add(void *addr);
+void	journal_commit(void);
+void	journal_init(void);
+
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+int	file_find_block(struct File *f, uint32_t file_blockno, char **pblk);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
-void	file_flush(struct File *f);
+int	file_flush(struct File *f);
+void	file_touch(struct File *f);
+uint32_t file_gen(struct File *f);
 int	file_remove(const char *path);
-void	fs_sync(void);
+int	fs_sync(void);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
+void	free_block(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_block_near(uint32_t hint);
+int	alloc_extent(uint32_t hint, uint32_t n, uint32_t *plen);
+void	bitmap_flush(void);
+
+/* tmpfs.c */
+int	tmp_open(const char *name, int omode, void **hdr);
+int	tmp_map(uint32_t id, uint32_t pageno, void **pg);
+int	tmp_set_size(uint32_t id, off_t newsize);
+int	tmp_extend(uint32_t id, off_t size);
+int	tmp_stat(const char *name, off_t *size, int *isdir);
+int	tmp_remove(const char *name);
+int	tmp_readdir(off_t offset, uint32_t max, struct Fsret_readdir *ret);
+
+/* serv.c */
+void	serve_wait(volatile uint32_t *addr, uint32_t val);
+void	serve_wakeup(volatile uint32_t *addr);
+
+/* timer.c */
+void	timer(envid_t fs_envid, uint32_t msec);
 
 /* test.c */
 void	fs_test(void);
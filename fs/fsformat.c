@@ -111,12 +111,17 @@ opendisk(const char *name)
 	super = alloc(BLKSIZE);
 	super->s_magic = FS_MAGIC;
 	super->s_nblocks = nblocks;
+	super->s_version = FS_VERSION;
 	super->s_root.f_type = FTYPE_DIR;
 	strcpy(super->s_root.f_name, "/");
 
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	// An empty journal: its header has no magic number yet
+	super->s_jstart = blockof(alloc(JOURNAL_NBLOCKS * BLKSIZE));
+	super->s_jnblocks = JOURNAL_NBLOCKS;
 }
 
 void
@@ -134,24 +139,37 @@ finishdisk(void)
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
+	int i, j;
+	uint32_t *ind, *dind;
 	f->f_size = len;
 	len = ROUNDUP(len, BLKSIZE);
 	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
 		f->f_direct[i] = start + i;
 	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
+		ind = alloc(BLKSIZE);
 		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
+		for (; i < len / BLKSIZE && i < NDIRECT + NINDIRECT; ++i)
 			ind[i - NDIRECT] = start + i;
 	}
+	if (i == NDIRECT + NINDIRECT && i < len / BLKSIZE) {
+		dind = alloc(BLKSIZE);
+		f->f_dindirect = blockof(dind);
+		for (; i < len / BLKSIZE; ++i) {
+			j = i - NDIRECT - NINDIRECT;
+			if (j % NINDIRECT == 0) {
+				ind = alloc(BLKSIZE);
+				dind[j / NINDIRECT] = blockof(ind);
+			}
+			ind[j % NINDIRECT] = start + i;
+		}
+	}
 }
 
 void
 startdir(struct File *f, struct Dir *dout)
 {
 	dout->f = f;
-	dout->ents = malloc(MAX_DIR_ENTS * sizeof *dout->ents);
+	dout->ents = calloc(MAX_DIR_ENTS, sizeof *dout->ents);
 	dout->n = 0;
 }
 
@@ -1,5 +1,10 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code: bus-master DMA when the controller supports
+ * it, PIO otherwise.  Neither is interrupt-driven: the end of a DMA
+ * transfer is noticed by polling, and the request that started it lets
+ * others run meanwhile (see serve_wait).
+ * If the disk is a virtio block device instead, ide_read and ide_write
+ * hand the transfer to virtio.c.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -14,6 +19,43 @@
 
 static int diskno = 1;
 
+// Bus-master IDE registers, relative to the primary channel's base
+// port, which the controller reports in BAR 4.
+#define BM_CMD		0
+#define BM_CMD_START	0x01
+#define BM_CMD_READ	0x08	// device to memory
+#define BM_STATUS	2
+#define BM_STATUS_ACTIVE 0x01
+#define BM_STATUS_ERR	0x02
+#define BM_STATUS_INTR	0x04
+#define BM_PRDT		4
+
+// A physical region descriptor: one physically contiguous piece of a
+// DMA transfer, which must not cross a 64KB boundary.
+struct IdePrd {
+	uint32_t prd_addr;
+	uint16_t prd_len;
+	uint16_t prd_flags;
+};
+#define PRD_EOT		0x8000	// last entry in the table
+
+static uint16_t bmide;		// bus-master base port, 0 if PIO only
+static struct IdePrd prdt[PGSIZE / sizeof(struct IdePrd)]
+	__attribute__((aligned(PGSIZE)));
+
+// The channel runs one transfer at a time.  While a DMA transfer is in
+// flight, dma_result points at the starter's result, which whoever
+// notices the end of the transfer fills in (see ide_poll).
+static volatile int *dma_result;
+static volatile uint32_t dma_ndone;	// DMA transfers finished
+
+// Writes go out of a copy of the data, so that the blocks being
+// written can change (and be dirtied again) while the disk reads them.
+static char dma_buf[BC_MAXRUN * BLKSIZE] __attribute__((aligned(PGSIZE)));
+
+// Shared with the timer env (see ide_share).
+struct IdeShared *ide_shared = (struct IdeShared*) IDE_SHAREDVA;
+
 static int
 ide_wait_ready(bool check_error)
 {
@@ -27,6 +69,113 @@ ide_wait_ready(bool check_error)
 	return 0;
 }
 
+static bool
+ide_match(uint32_t id, uint32_t class)
+{
+	// Mass storage, IDE
+	return PCI_CLASS(class) == 0x01 && PCI_SUBCLASS(class) == 0x01;
+}
+
+// Look for a PCI IDE controller that can do bus-master DMA.
+// Without one, ide_read and ide_write use PIO.
+void
+ide_init(void)
+{
+	uint32_t tag, bar;
+
+	if (ide_shared->is_vioport || pci_find(ide_match, &tag) < 0)
+		return;
+	bar = pci_conf_read(tag, PCI_BAR(4));
+	if (!(bar & 1) || !(bar & 0xFFFC))
+		return;
+	pci_conf_write(tag, PCI_COMMAND_STATUS_REG,
+		       pci_conf_read(tag, PCI_COMMAND_STATUS_REG)
+		       | PCI_COMMAND_IO_ENABLE | PCI_COMMAND_MASTER_ENABLE);
+	bmide = bar & 0xFFFC;
+	ide_shared->is_bmide = bmide;
+	cprintf("IDE: bus-master DMA at port %04x\n", bmide);
+}
+
+// Allocate the page that the driver shares with the timer env, which
+// watches DMA transfers while the server waits in ipc_recv, and set up
+// the virtio-blk queue if there is one, which the timer watches too.
+// Call before forking the timer.
+void
+ide_share(void)
+{
+	int r;
+
+	if ((r = sys_page_alloc(0, ide_shared, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("ide_share: sys_page_alloc: %e", r);
+	virtio_init();
+}
+
+// Has the DMA transfer in flight, if any, come to an end?  Only reads
+// the shared page and the bus-master status, so the timer env can ask.
+// For virtio-blk, has the device finished requests not yet taken?
+bool
+ide_dma_ended(void)
+{
+	uint8_t status;
+
+	if (ide_shared->is_vioport)
+		return *ide_shared->is_vio_used != ide_shared->is_vio_seen;
+	if (!ide_shared->is_busy)
+		return 0;
+	status = inb(ide_shared->is_bmide + BM_STATUS);
+	return (status & (BM_STATUS_INTR | BM_STATUS_ERR)) != 0
+		|| !(status & BM_STATUS_ACTIVE);
+}
+
+// Changes whenever a transfer starts (IDE) or ends (virtio-blk), so
+// that the timer env wakes the server once per event.
+uint32_t
+ide_dma_seq(void)
+{
+	if (ide_shared->is_vioport)
+		return *ide_shared->is_vio_used;
+	return ide_shared->is_seq;
+}
+
+// If the DMA transfer in flight has ended, stop the bus master and
+// hand the result to the request that started it.
+void
+ide_poll(void)
+{
+	uint8_t status;
+	int r;
+
+	if (ide_shared->is_vioport) {
+		virtio_poll();
+		return;
+	}
+	if (!ide_dma_ended())
+		return;
+	status = inb(bmide + BM_STATUS);
+	outb(bmide + BM_CMD, inb(bmide + BM_CMD) & ~BM_CMD_START);
+	outb(bmide + BM_STATUS, BM_STATUS_INTR | BM_STATUS_ERR);
+
+	// Reading the drive status also acknowledges its interrupt.
+	if ((r = ide_wait_ready(1)) == 0 && (status & BM_STATUS_ERR))
+		r = -1;
+	*dma_result = r;
+	dma_result = NULL;
+	ide_shared->is_busy = 0;
+	dma_ndone++;
+	serve_wakeup(&dma_ndone);
+}
+
+// Wait for a while for the DMA transfer in flight to end.
+static void
+ide_dma_wait(void)
+{
+	uint32_t ndone = dma_ndone;
+
+	ide_poll();
+	if (dma_ndone == ndone)
+		serve_wait(&dma_ndone, ndone);
+}
+
 bool
 ide_probe_disk1(void)
 {
@@ -60,13 +209,95 @@ ide_set_disk(int d)
 }
 
 
+// Fill in prdt for a transfer of 'len' bytes at 'buf', one entry per
+// page.  If the device writes memory, every page must be mapped
+// writable: DMA bypasses the MMU, and a read-only page may be shared.
+// Returns 0 on success, -E_INVAL if the buffer cannot be used for DMA.
+static int
+ide_dma_prd(const void *buf, size_t len, bool to_mem)
+{
+	pte_t pte;
+	size_t n;
+	int i;
+
+	if ((uintptr_t) buf & 1)
+		return -E_INVAL;
+	for (i = 0; len > 0; i++, buf += n, len -= n) {
+		if (!(uvpd[PDX(buf)] & PTE_P))
+			return -E_INVAL;
+		pte = uvpt[PGNUM(buf)];
+		if (!(pte & PTE_P) || (to_mem && !(pte & PTE_W)))
+			return -E_INVAL;
+		n = MIN(len, PGSIZE - PGOFF(buf));
+		prdt[i].prd_addr = PTE_ADDR(pte) | PGOFF(buf);
+		prdt[i].prd_len = n;
+		prdt[i].prd_flags = 0;
+	}
+	prdt[i - 1].prd_flags = PRD_EOT;
+	return 0;
+}
+
+// Transfer 'nsecs' sectors starting at 'secno' between the disk and
+// 'buf' by bus-master DMA.  There is no way to route the disk interrupt
+// to us, so we poll the bus-master status, letting other requests run
+// between polls instead of spinning through the transfer.
+// Returns 0 on success, -E_NOT_SUPP if the transfer has to use PIO,
+// or another error.
+static int
+ide_dma(uint32_t secno, const void *buf, size_t nsecs, bool to_mem)
+{
+	volatile int result = 1;
+
+	if (!bmide)
+		return -E_NOT_SUPP;
+
+	// PIO cannot share the channel with a transfer either.
+	while (ide_shared->is_busy)
+		ide_dma_wait();
+	if (!to_mem) {
+		memmove(dma_buf, buf, nsecs * SECTSIZE);
+		buf = dma_buf;
+	}
+	if (ide_dma_prd(buf, nsecs * SECTSIZE, to_mem) < 0)
+		return -E_NOT_SUPP;
+
+	ide_wait_ready(0);
+
+	outb(bmide + BM_CMD, to_mem ? BM_CMD_READ : 0);
+	outl(bmide + BM_PRDT, PTE_ADDR(uvpt[PGNUM(prdt)]));
+	outb(bmide + BM_STATUS, BM_STATUS_INTR | BM_STATUS_ERR);
+
+	outb(0x1F2, nsecs);
+	outb(0x1F3, secno & 0xFF);
+	outb(0x1F4, (secno >> 8) & 0xFF);
+	outb(0x1F5, (secno >> 16) & 0xFF);
+	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
+	outb(0x1F7, to_mem ? 0xC8 : 0xCA);	// READ DMA, WRITE DMA
+
+	outb(bmide + BM_CMD, inb(bmide + BM_CMD) | BM_CMD_START);
+
+	// Only now, with the bus master active, may the timer env look.
+	dma_result = &result;
+	ide_shared->is_seq++;
+	ide_shared->is_busy = 1;
+	while (result == 1)
+		ide_dma_wait();
+	return result;
+}
+
 int
 ide_read(uint32_t secno, void *dst, size_t nsecs)
 {
 	int r;
 
+	if (ide_shared->is_vioport)
+		return virtio_rw(secno, dst, nsecs, 1);
+
 	assert(nsecs <= 256);
 
+	if ((r = ide_dma(secno, dst, nsecs, 1)) != -E_NOT_SUPP)
+		return r;
+
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -90,8 +321,14 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 {
 	int r;
 
+	if (ide_shared->is_vioport)
+		return virtio_rw(secno, src, nsecs, 0);
+
 	assert(nsecs <= 256);
 
+	if ((r = ide_dma(secno, src, nsecs, 0)) != -E_NOT_SUPP)
+		return r;
+
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -0,0 +1,189 @@
+#include "fs.h"
+
+// Metadata journal.
+//
+// Bitmap, inode, indirect and directory blocks are not written back
+// one at a time as they change.  journal_add puts a changed block in
+// the running transaction instead, and journal_commit writes the
+// whole transaction to the journal with a single sequential write.
+// Until then the block cache holds back the transaction's blocks (see
+// journal_busy), so the disk never sees half of an update.
+//
+// Checkpointing is lazy: the committed blocks stay dirty in the cache
+// and go home with the next background write-back.  The journal only
+// holds one transaction, so before a commit overwrites it the
+// previous one is checkpointed.  Recovery therefore replays at most
+// JOURNAL_NBLOCKS blocks.
+//
+// An update must not be split across two transactions, so updates
+// start with journal_begin, which commits first if the update might
+// not fit in what is left of the running transaction.  An update may
+// outgrow its reservation into whatever room is left, but one that
+// fills the transaction is a bug, and panics rather than commit half
+// of itself.
+
+static uint32_t jnl_blocks[JOURNAL_MAXBLOCKS];	// running transaction
+static uint32_t jnl_n;
+static uint32_t jnl_prev[JOURNAL_MAXBLOCKS];	// last committed one
+static uint32_t jnl_nprev;
+static uint32_t jnl_max;	// blocks per transaction, 0 if no journal
+static uint32_t jnl_seq;
+
+// Header and block images, staged for one ide_write
+static char jnl_buf[JOURNAL_NBLOCKS * BLKSIZE] __attribute__((aligned(BLKSIZE)));
+
+static uint32_t
+jnl_sum(const uint32_t *p, uint32_t nwords, uint32_t sum)
+{
+	uint32_t i;
+
+	for (i = 0; i < nwords; i++)
+		sum = (sum << 1 | sum >> 31) + p[i];
+	return sum;
+}
+
+// The checksum of the transaction in jnl_buf.  It covers the home
+// block numbers too, so that a torn header cannot send the logged
+// blocks to the wrong places.
+static uint32_t
+jnl_txsum(void)
+{
+	struct JournalHeader *jh = (struct JournalHeader*) jnl_buf;
+	uint32_t sum;
+
+	sum = jnl_sum(jh->jh_blocknos, jh->jh_nblocks, jh->jh_seq);
+	return jnl_sum((uint32_t*) (jnl_buf + BLKSIZE),
+		       jh->jh_nblocks * BLKSIZE / 4, sum);
+}
+
+// Is the journal in use on this disk?
+bool
+journal_on(void)
+{
+	return jnl_max != 0;
+}
+
+// Is block 'blockno' part of the running transaction?  Such blocks
+// must not be written home before the transaction commits.
+bool
+journal_busy(uint32_t blockno)
+{
+	uint32_t i;
+
+	for (i = 0; i < jnl_n; i++)
+		if (jnl_blocks[i] == blockno)
+			return 1;
+	return 0;
+}
+
+// Start an update that changes at most 'n' more metadata blocks.
+// Call only where the file system is consistent: if the running
+// transaction might not have room, it is committed here.
+void
+journal_begin(uint32_t n)
+{
+	if (jnl_max && jnl_n + MIN(n, jnl_max) > jnl_max)
+		journal_commit();
+}
+
+// Note that the metadata block containing 'addr' has changed.
+// Does nothing if the disk has no journal.
+void
+journal_add(void *addr)
+{
+	uint32_t blockno = ((uint32_t) addr - DISKMAP) / BLKSIZE;
+
+	if (!jnl_max || journal_busy(blockno))
+		return;
+	// Only an update much bigger than its journal_begin said gets
+	// here, and committing now would split it
+	if (jnl_n == jnl_max)
+		panic("journal: update overflows the transaction at block %d",
+		      blockno);
+	jnl_blocks[jnl_n++] = blockno;
+}
+
+// Commit the running transaction to the journal.
+void
+journal_commit(void)
+{
+	struct JournalHeader *jh = (struct JournalHeader*) jnl_buf;
+	uint32_t i;
+	int r;
+
+	if (jnl_n == 0)
+		return;
+
+	// The journal is about to be overwritten, so the previous
+	// transaction must be home first.  Blocks it shares with this
+	// one are held back by journal_busy; this commit covers them.
+	bc_flush_blocks(jnl_prev, jnl_nprev);
+
+	for (i = 0; i < jnl_n; i++)
+		memmove(jnl_buf + (i + 1) * BLKSIZE, diskaddr(jnl_blocks[i]), BLKSIZE);
+	jh->jh_magic = JOURNAL_MAGIC;
+	jh->jh_seq = ++jnl_seq;
+	jh->jh_nblocks = jnl_n;
+	memmove(jh->jh_blocknos, jnl_blocks, jnl_n * sizeof(jnl_blocks[0]));
+	jh->jh_sum = jnl_txsum();
+
+	if ((r = ide_write(super->s_jstart * BLKSECTS, jnl_buf,
+			   (jnl_n + 1) * BLKSECTS)) < 0)
+		panic("journal_commit: ide_write failed: %e", r);
+	fs_stats.fs_writes++;
+	fs_stats.fs_commits++;
+	fs_stats.fs_blocks_logged += jnl_n;
+
+	memmove(jnl_prev, jnl_blocks, jnl_n * sizeof(jnl_blocks[0]));
+	jnl_nprev = jnl_n;
+	jnl_n = 0;
+}
+
+// Find the journal, and replay the transaction in it if that was
+// committed.  The header is cleared once the blocks are home, so a
+// later boot cannot replay them again over newer contents.  Call
+// after check_super, before anything else is read.
+void
+journal_init(void)
+{
+	struct JournalHeader *jh = (struct JournalHeader*) jnl_buf;
+	uint32_t i;
+	int r;
+
+	if (super->s_version < 3 || super->s_jnblocks < 2)
+		return;
+	if (super->s_jstart < 2 || super->s_jnblocks > JOURNAL_NBLOCKS
+	    || super->s_jstart + super->s_jnblocks > super->s_nblocks)
+		panic("bad journal at block %d, %d blocks",
+		      super->s_jstart, super->s_jnblocks);
+	jnl_max = MIN(super->s_jnblocks - 1, JOURNAL_MAXBLOCKS);
+
+	if ((r = ide_read(super->s_jstart * BLKSECTS, jnl_buf, BLKSECTS)) < 0)
+		panic("journal_init: ide_read failed: %e", r);
+	if (jh->jh_magic != JOURNAL_MAGIC || jh->jh_nblocks > jnl_max)
+		return;
+	jnl_seq = jh->jh_seq;
+	if ((r = ide_read((super->s_jstart + 1) * BLKSECTS, jnl_buf + BLKSIZE,
+			  jh->jh_nblocks * BLKSECTS)) < 0)
+		panic("journal_init: ide_read failed: %e", r);
+	if (jh->jh_sum != jnl_txsum()) {
+		cprintf("journal: transaction %d is incomplete, ignored\n",
+			jh->jh_seq);
+		return;
+	}
+
+	for (i = 0; i < jh->jh_nblocks; i++) {
+		if (jh->jh_blocknos[i] >= super->s_jstart
+		    && jh->jh_blocknos[i] < super->s_jstart + super->s_jnblocks)
+			panic("journal logs its own block %d", jh->jh_blocknos[i]);
+		memmove(diskaddr(jh->jh_blocknos[i]), jnl_buf + (i + 1) * BLKSIZE,
+			BLKSIZE);
+		flush_block(diskaddr(jh->jh_blocknos[i]));
+	}
+	cprintf("journal: replayed transaction %d, %d blocks\n",
+		jh->jh_seq, jh->jh_nblocks);
+
+	memset(jh, 0, BLKSIZE);
+	if ((r = ide_write(super->s_jstart * BLKSECTS, jnl_buf, BLKSECTS)) < 0)
+		panic("journal_init: ide_write failed: %e", r);
+}
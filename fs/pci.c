@@ -0,0 +1,59 @@
+/*
+ * Just enough PCI configuration space access for the file system
+ * server to find its disk controller.  The server runs with I/O
+ * privilege, so it uses configuration mechanism #1 directly.
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+#define PCI_CONF_ADDR	0xCF8
+#define PCI_CONF_DATA	0xCFC
+
+#define PCI_ID_REG		0x00
+#define PCI_CLASS_REG		0x08
+#define PCI_BHLC_REG		0x0C
+
+#define PCI_HDRTYPE_MULTIFN(bhlc)	(((bhlc) >> 16) & 0x80)
+
+uint32_t
+pci_conf_read(uint32_t tag, uint32_t reg)
+{
+	outl(PCI_CONF_ADDR, 0x80000000 | tag | (reg & 0xFC));
+	return inl(PCI_CONF_DATA);
+}
+
+void
+pci_conf_write(uint32_t tag, uint32_t reg, uint32_t v)
+{
+	outl(PCI_CONF_ADDR, 0x80000000 | tag | (reg & 0xFC));
+	outl(PCI_CONF_DATA, v);
+}
+
+// Find the first function on bus 0 for which match(id, class) is true,
+// where id is the vendor/device register and class the class register,
+// and store its tag in *tag.  QEMU puts all its devices on bus 0, so
+// we do not walk bridges.
+// Returns 0 on success, -E_NOT_FOUND if nothing matches.
+int
+pci_find(bool (*match)(uint32_t id, uint32_t class), uint32_t *tag)
+{
+	uint32_t dev, func, nfunc, t, id;
+
+	for (dev = 0; dev < 32; dev++) {
+		nfunc = 1;
+		for (func = 0; func < nfunc; func++) {
+			t = PCI_TAG(0, dev, func);
+			id = pci_conf_read(t, PCI_ID_REG);
+			if ((id & 0xFFFF) == 0xFFFF)
+				continue;
+			if (func == 0 && PCI_HDRTYPE_MULTIFN(pci_conf_read(t, PCI_BHLC_REG)))
+				nfunc = 8;
+			if (match(id, pci_conf_read(t, PCI_CLASS_REG))) {
+				*tag = t;
+				return 0;
+			}
+		}
+	}
+	return -E_NOT_FOUND;
+}
@@ -5,6 +5,7 @@
 
 #include <inc/x86.h>
 #include <inc/string.h>
+#include <arch/thread.h>
 
 #include "fs.h"
 
@@ -22,7 +23,7 @@
 //    on *its own page* in memory, and it is shared with any
 //    environments that have the file open.
 // 3. 'struct OpenFile' links these other two structures, and is kept
-//    private to the file server.  The server maintains an array of
+//    private to the file server.  The server maintains a table of
 //    all open files, indexed by "file ID".  (There can be at most
 //    MAXOPEN files open concurrently.)  The client uses file IDs to
 //    communicate with the server.  File IDs are a lot like
@@ -32,55 +33,222 @@
 struct OpenFile {
 	uint32_t o_fileid;	// file id
 	struct File *o_file;	// mapped descriptor for open file
+	uint32_t o_tmpid;	// tmpfs file ID, when o_file is NULL
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	envid_t o_claim;	// env yet to claim o_fd, see FSREQ_CLAIM
+	struct OpenFile *o_next;	// next free entry
+	bool o_free;		// on the free list
 };
 
-// Max number of open files in the file system at once
-#define MAXOPEN		1024
+// Max number of open files in the file system at once.  The table
+// starts empty and grows OPENCHUNK entries at a time; entry i's Fd page
+// lives at FILEVA + i * PGSIZE.
+#define MAXOPEN		65536
+#define OPENCHUNK	256
 #define FILEVA		0xD0000000
 
-// initialize to force into data section
-struct OpenFile opentab[MAXOPEN] = {
-	{ 0, 0, 1, 0 }
+// Entries whose Fd page has dropped to our own reference go back on the
+// free list.  Nothing tells us when that happens, so each allocation
+// checks the next OPENSCAN entries, round-robin.
+#define OPENSCAN	4
+
+static struct OpenFile *opentab[MAXOPEN / OPENCHUNK];
+static uint32_t nopen;			// entries in the table
+static uint32_t open_hand;		// next entry to check
+static struct OpenFile *open_free;
+
+// Virtual addresses at which to receive page mappings containing client
+// requests, one page for each request in progress.
+#define NREQ		32
+
+static uint32_t req_busy;		// bit i: page i holds a request
+static volatile uint32_t req_nfree = NREQ;
+
+// Each request runs in a thread of its own (see serve), and the
+// threads switch only when one waits for the disk or for another.
+// Requests that only read share the file system; those that change it
+// have it to themselves.  Write-back shuts out writers, not readers.
+enum { FS_READ, FS_WRITE, FS_SYNC };
+
+static volatile uint32_t fs_readers;	// readers in progress
+static volatile uint32_t fs_writing;	// a writer is in progress
+static volatile uint32_t fs_busy;	// held by a writer or write-back
+static bool serving;			// requests run in threads
+
+struct ServeArgs {
+	envid_t whom;
+	uint32_t req;
+	int perm;
+	union Fsipc *ipc;
+};
+
+// Regions that clients share with us a page at a time: bulk I/O
+// windows (see FSREQ_WINDOW) and asynchronous I/O regions (see
+// FSREQ_AIO_SETUP).  Window i of a table is mapped at
+// ws_va + i * ws_npages * PGSIZE.  When all are in use, registering a
+// new one takes over a window whose owner is gone, or failing that,
+// if the table allows it, the one used least recently.  A bulk I/O
+// window is only a shortcut, but an aio region has requests in flight,
+// so a live owner keeps it.
+#define NWINDOW		8
+
+struct Window {
+	envid_t w_envid;	// owner
+	uint32_t w_npages;	// pages mapped so far
+	uint32_t w_used;	// ws_clock when last looked up
+};
+
+struct Windows {
+	uintptr_t ws_va;
+	uint32_t ws_npages;	// pages in a complete window
+	bool ws_evict;		// take over live owners' windows
+	uint32_t ws_clock;	// lookups so far
+	struct Window ws_win[NWINDOW];
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+static struct Windows windows = { WINDOWVA, FSWINDOW_NPAGES, 1 };
+static struct Windows aio_regions = { AIOVA, AIO_NPAGES, 0 };
+
+// Asynchronous requests in progress in each region.  Taking no more
+// than AIO_NSLOTS off a submission ring at a time keeps a client from
+// tying up more threads than a well-behaved one could.
+static uint32_t aio_inflight[NWINDOW];
+
+struct AioArgs {
+	envid_t whom;
+	uint32_t region;
+	struct AioSqe sqe;
+};
+
+// The env that sends us FSREQ_TIMER (see timer.c)
+static envid_t timer_envid;
+
+// Return entry i of the open-file table.
+static struct OpenFile *
+openfile(uint32_t i)
+{
+	return &opentab[i / OPENCHUNK][i % OPENCHUNK];
+}
+
+// Add OPENCHUNK entries to the open-file table, onto the free list.
+static int
+openfile_grow(void)
+{
+	struct OpenFile *chunk;
+	uint32_t i;
+
+	if (nopen == MAXOPEN)
+		return -E_MAX_OPEN;
+	if ((chunk = malloc(OPENCHUNK * sizeof(struct OpenFile))) == NULL)
+		return -E_NO_MEM;
+	memset(chunk, 0, OPENCHUNK * sizeof(struct OpenFile));
+	opentab[nopen / OPENCHUNK] = chunk;
+	for (i = OPENCHUNK; i-- > 0; ) {
+		chunk[i].o_fileid = nopen + i;
+		chunk[i].o_fd = (struct Fd*) (FILEVA + (nopen + i) * PGSIZE);
+		chunk[i].o_next = open_free;
+		chunk[i].o_free = 1;
+		open_free = &chunk[i];
+	}
+	nopen += OPENCHUNK;
+	return 0;
+}
 
 void
 serve_init(void)
 {
-	int i;
-	uintptr_t va = FILEVA;
-	for (i = 0; i < MAXOPEN; i++) {
-		opentab[i].o_fileid = i;
-		opentab[i].o_fd = (struct Fd*) va;
-		va += PGSIZE;
+	if (openfile_grow() < 0)
+		panic("serve_init: no memory for the open-file table");
+}
+
+// Is envid still around?
+static bool
+env_alive(envid_t envid)
+{
+	const volatile struct Env *e = &envs[ENVX(envid)];
+
+	return envid && e->env_id == envid && e->env_status != ENV_FREE;
+}
+
+// How long a reply waits for its client to receive it
+#define SEND_MSEC	200
+
+// Send a reply to envid, like ipc_send, but give up rather than panic
+// or spin for good if envid has exited or does not receive it: a
+// client that is not runnable is not on its way to ipc_recv, and
+// one that takes longer than SEND_MSEC is not coming.
+// Returns 0 on success, < 0 on error.
+static int
+serve_send(envid_t envid, uint32_t val, void *pg, int perm)
+{
+	const volatile struct Env *e = &envs[ENVX(envid)];
+	uint32_t start = sys_time_msec();
+	int r;
+
+	if (pg == NULL)
+		pg = (void*) (UTOP + PGSIZE);
+	while ((r = sys_ipc_try_send(envid, val, pg, perm)) == -E_IPC_NOT_RECV) {
+		if (!env_alive(envid)
+		    || (e->env_status != ENV_RUNNABLE && e->env_status != ENV_RUNNING)
+		    || sys_time_msec() - start > SEND_MSEC)
+			break;
+		sys_yield();
 	}
+	if (r < 0 && debug)
+		cprintf("serve_send %08x: %e\n", envid, r);
+	return r;
+}
+
+// Was o opened through a submission ring by an env that is still
+// around to claim it?  Until then only the server maps its Fd page.
+static bool
+openfile_unclaimed(struct OpenFile *o)
+{
+	return env_alive(o->o_claim);
+}
+
+// Put o back on the free list if nobody has it open any more.
+static void
+openfile_reclaim(struct OpenFile *o)
+{
+	if (o->o_free || pageref(o->o_fd) > 1 || openfile_unclaimed(o))
+		return;
+	o->o_next = open_free;
+	o->o_free = 1;
+	open_free = o;
 }
 
 // Allocate an open file.
 int
 openfile_alloc(struct OpenFile **o)
 {
-	int i, r;
-
-	// Find an available open-file table entry
-	for (i = 0; i < MAXOPEN; i++) {
-		switch (pageref(opentab[i].o_fd)) {
-		case 0:
-			if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			/* fall through */
-		case 1:
-			opentab[i].o_fileid += MAXOPEN;
-			*o = &opentab[i];
-			memset(opentab[i].o_fd, 0, PGSIZE);
-			return (*o)->o_fileid;
-		}
+	uint32_t i;
+	int r;
+
+	for (i = 0; i < OPENSCAN; i++) {
+		openfile_reclaim(openfile(open_hand));
+		open_hand = (open_hand + 1) % nopen;
 	}
-	return -E_MAX_OPEN;
+
+	// Grow the table rather than search it, unless it is full
+	if (!open_free && openfile_grow() < 0)
+		for (i = 0; i < nopen; i++)
+			openfile_reclaim(openfile(i));
+	if (!open_free)
+		return -E_MAX_OPEN;
+
+	*o = open_free;
+	if (pageref((*o)->o_fd) == 0
+	    && (r = sys_page_alloc(0, (*o)->o_fd, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	open_free = (*o)->o_next;
+	(*o)->o_free = 0;
+	(*o)->o_claim = 0;
+	// Keep file IDs positive, since clients see them as results
+	(*o)->o_fileid = ((*o)->o_fileid + MAXOPEN) & 0x7FFFFFFF;
+	memset((*o)->o_fd, 0, PGSIZE);
+	return (*o)->o_fileid;
 }
 
 // Look up an open file for envid.
@@ -89,13 +257,42 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 {
 	struct OpenFile *o;
 
-	o = &opentab[fileid % MAXOPEN];
-	if (pageref(o->o_fd) <= 1 || o->o_fileid != fileid)
+	if (fileid % MAXOPEN >= nopen)
+		return -E_INVAL;
+	o = openfile(fileid % MAXOPEN);
+	if (pageref(o->o_fd) <= 1 || o->o_fileid != fileid || !o->o_file)
 		return -E_INVAL;
 	*po = o;
 	return 0;
 }
 
+// Look up an open file of the tmpfs for envid.  If 'write' is set, it
+// must have been opened for writing.
+static int
+openfile_lookup_tmp(envid_t envid, uint32_t fileid, bool write,
+		    struct OpenFile **po)
+{
+	struct OpenFile *o;
+
+	if (fileid % MAXOPEN >= nopen)
+		return -E_INVAL;
+	o = openfile(fileid % MAXOPEN);
+	if (pageref(o->o_fd) <= 1 || o->o_fileid != fileid || o->o_file)
+		return -E_INVAL;
+	if (write && (o->o_mode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	*po = o;
+	return 0;
+}
+
+// Does an open in mode 'omode' change the file system?  Other opens
+// only look the path up, and run as readers.
+static bool
+open_writes(int omode)
+{
+	return (omode & (O_ACCMODE | O_CREAT | O_TRUNC | O_MKDIR)) != 0;
+}
+
 // Open req->req_path in mode req->req_omode, storing the Fd page and
 // permissions to return to the calling environment in *pg_store and
 // *perm_store respectively.
@@ -103,57 +300,68 @@ int
 serve_open(envid_t envid, struct Fsreq_open *req,
 	   void **pg_store, int *perm_store)
 {
-	char path[MAXPATHLEN];
 	struct File *f;
-	int fileid;
-	int r;
+	char *path;
+	int omode, r;
 	struct OpenFile *o;
 
 	if (debug)
 		cprintf("serve_open %08x %s 0x%x\n", envid, req->req_path, req->req_omode);
 
-	// Copy in the path, making sure it's null-terminated
+	// The caller chose the lock from the mode, which a ring's client
+	// may have changed since
+	omode = req->req_omode;
+	if (open_writes(omode) && !fs_writing)
+		return -E_INVAL;
+	// Copy in the path, making sure it's null-terminated.  Not on the
+	// stack: a request thread's stack is a few KB with no guard page
+	// below it, and read-only opens run side by side.
+	if ((path = malloc(MAXPATHLEN)) == NULL)
+		return -E_NO_MEM;
 	memmove(path, req->req_path, MAXPATHLEN);
 	path[MAXPATHLEN-1] = 0;
 
-	// Find an open file ID
-	if ((r = openfile_alloc(&o)) < 0) {
-		if (debug)
-			cprintf("openfile_alloc failed: %e", r);
-		return r;
-	}
-	fileid = r;
-
 	// Open the file
-	if (req->req_omode & O_CREAT) {
+	if (omode & O_CREAT) {
 		if ((r = file_create(path, &f)) < 0) {
-			if (!(req->req_omode & O_EXCL) && r == -E_FILE_EXISTS)
+			if (!(omode & O_EXCL) && r == -E_FILE_EXISTS)
 				goto try_open;
 			if (debug)
 				cprintf("file_create failed: %e", r);
-			return r;
+			goto out;
 		}
 	} else {
 try_open:
 		if ((r = file_open(path, &f)) < 0) {
 			if (debug)
 				cprintf("file_open failed: %e", r);
-			return r;
+			goto out;
 		}
 	}
 
 	// Truncate
-	if (req->req_omode & O_TRUNC) {
+	if (omode & O_TRUNC) {
 		if ((r = file_set_size(f, 0)) < 0) {
 			if (debug)
 				cprintf("file_set_size failed: %e", r);
-			return r;
+			goto out;
 		}
 	}
 	if ((r = file_open(path, &f)) < 0) {
 		if (debug)
 			cprintf("file_open failed: %e", r);
-		return r;
+		goto out;
+	}
+	if (open_writes(omode))
+		file_touch(f);
+
+	// Find an open file ID.  Only now: an unshared Fd page may be
+	// reclaimed by any open that runs while this one waits for the
+	// disk.
+	if ((r = openfile_alloc(&o)) < 0) {
+		if (debug)
+			cprintf("openfile_alloc failed: %e", r);
+		goto out;
 	}
 
 	// Save the file pointer
@@ -161,9 +369,9 @@ try_open:
 
 	// Fill out the Fd structure
 	o->o_fd->fd_file.id = o->o_fileid;
-	o->o_fd->fd_omode = req->req_omode & O_ACCMODE;
+	o->o_fd->fd_omode = omode & O_ACCMODE;
 	o->o_fd->fd_dev_id = devfile.dev_id;
-	o->o_mode = req->req_omode;
+	o->o_mode = omode;
 
 	if (debug)
 		cprintf("sending success, page %08x\n", (uintptr_t) o->o_fd);
@@ -172,8 +380,11 @@ try_open:
 	// store its permission in *perm_store
 	*pg_store = o->o_fd;
 	*perm_store = PTE_P|PTE_U|PTE_W|PTE_SHARE;
+	r = 0;
 
-	return 0;
+out:
+	free(path);
+	return r;
 }
 
 // Set the size of req->req_fileid to req->req_size bytes, truncating
@@ -221,7 +432,8 @@ serve_read(envid_t envid, union Fsipc *ipc)
         return r;
     }
 
-    if ((r = file_read(o->o_file, ret->ret_buf, req->req_n, o->o_fd->fd_offset)) < 0)
+    if ((r = file_read(o->o_file, ret->ret_buf, MIN(req->req_n, PGSIZE),
+                       o->o_fd->fd_offset)) < 0)
     {
         return r;
     }
@@ -261,6 +473,149 @@ serve_write(envid_t envid, struct Fsreq_write *req)
     return r;
 }
 
+// Return the address of envid's complete window in 'ws', or NULL if it
+// has none.
+static char *
+window_lookup(struct Windows *ws, envid_t envid)
+{
+	int i;
+
+	for (i = 0; i < NWINDOW; i++)
+		if (ws->ws_win[i].w_envid == envid
+		    && ws->ws_win[i].w_npages == ws->ws_npages) {
+			ws->ws_win[i].w_used = ++ws->ws_clock;
+			return (char*) (ws->ws_va + i * ws->ws_npages * PGSIZE);
+		}
+	return NULL;
+}
+
+// Choose the window of 'ws' that a new one replaces: a free one, one
+// whose owner is gone, or else the one used least recently.  Returns
+// NULL if there is none and 'ws' does not evict live owners.
+static struct Window *
+window_victim(struct Windows *ws)
+{
+	struct Window *w, *lru;
+
+	lru = ws->ws_win;
+	for (w = ws->ws_win; w < ws->ws_win + NWINDOW; w++) {
+		if (!env_alive(w->w_envid))
+			return w;
+		if (w->w_used < lru->w_used)
+			lru = w;
+	}
+	return ws->ws_evict ? lru : NULL;
+}
+
+// Keep the request page as page ipc->window.req_index of envid's
+// window in 'ws'.  Pages must arrive in order; page 0 starts a new
+// window.
+static int
+window_add(struct Windows *ws, envid_t envid, union Fsipc *ipc)
+{
+	struct Window *w;
+	uint32_t i, index = ipc->window.req_index;
+	char *va;
+	int r;
+
+	for (w = ws->ws_win; w < ws->ws_win + NWINDOW; w++)
+		if (w->w_envid == envid)
+			break;
+	if (index == 0 && w == ws->ws_win + NWINDOW)
+		w = window_victim(ws);
+	// Without page 0 of its own, the table was full
+	if (w == NULL || w == ws->ws_win + NWINDOW)
+		return -E_NO_MEM;
+	if ((index != 0 && index != w->w_npages) || index >= ws->ws_npages)
+		return -E_INVAL;
+
+	va = (char*) (ws->ws_va + (w - ws->ws_win) * ws->ws_npages * PGSIZE);
+	if (index == 0)
+		for (i = 0; i < w->w_npages; i++)
+			sys_page_unmap(0, va + i * PGSIZE);
+	w->w_envid = envid;
+	w->w_npages = index;
+	w->w_used = ++ws->ws_clock;
+	if ((r = sys_page_map(0, ipc, 0, va + index * PGSIZE,
+			      PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	w->w_npages++;
+	return 0;
+}
+
+// The table that the pages of request 'req' go to, or NULL if it is
+// not one that hands us a region.
+static struct Windows *
+window_table(uint32_t req)
+{
+	if (req == FSREQ_WINDOW)
+		return &windows;
+	if (req == FSREQ_AIO_SETUP)
+		return &aio_regions;
+	return NULL;
+}
+
+// Keep the last page of envid's bulk I/O window.  The pages before it
+// were kept as they arrived, by serve.
+int
+serve_window(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_window %08x %d\n", envid, ipc->window.req_index);
+
+	return window_add(&windows, envid, ipc);
+}
+
+// Read at most ipc->io.req_n bytes, and no more than FSWINDOW_SIZE,
+// from the current seek position in ipc->io.req_fileid into the
+// caller's window, and update the seek position.  Returns the number of
+// bytes read, -E_NOT_FOUND if the caller has no window, or < 0 on error.
+int
+serve_read_window(envid_t envid, union Fsipc *ipc)
+{
+	struct OpenFile *o;
+	char *va;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_window %08x %08x %08x\n", envid,
+			ipc->io.req_fileid, ipc->io.req_n);
+
+	if ((r = openfile_lookup(envid, ipc->io.req_fileid, &o)) < 0)
+		return r;
+	if ((va = window_lookup(&windows, envid)) == NULL)
+		return -E_NOT_FOUND;
+	if ((r = file_read(o->o_file, va, MIN(ipc->io.req_n, FSWINDOW_SIZE),
+			   o->o_fd->fd_offset)) < 0)
+		return r;
+	o->o_fd->fd_offset += r;
+	return r;
+}
+
+// Like serve_write, but take up to FSWINDOW_SIZE bytes from the
+// caller's window.
+int
+serve_write_window(envid_t envid, union Fsipc *ipc)
+{
+	struct OpenFile *o;
+	char *va;
+	int r;
+
+	if (debug)
+		cprintf("serve_write_window %08x %08x %08x\n", envid,
+			ipc->io.req_fileid, ipc->io.req_n);
+
+	if ((r = openfile_lookup(envid, ipc->io.req_fileid, &o)) < 0)
+		return r;
+	if ((va = window_lookup(&windows, envid)) == NULL)
+		return -E_NOT_FOUND;
+	if ((r = file_write(o->o_file, va, MIN(ipc->io.req_n, FSWINDOW_SIZE),
+			    o->o_fd->fd_offset)) < 0)
+		return r;
+	o->o_fd->fd_offset += r;
+	return r;
+}
+
 // Stat ipc->stat.req_fileid.  Return the file's struct Stat to the
 // caller in ipc->statRet.
 int
@@ -280,9 +635,253 @@ serve_stat(envid_t envid, union Fsipc *ipc)
 	strcpy(ret->ret_name, o->o_file->f_name);
 	ret->ret_size = o->o_file->f_size;
 	ret->ret_isdir = (o->o_file->f_type == FTYPE_DIR);
+	ret->ret_gen = file_gen(o->o_file);
 	return 0;
 }
 
+// Return up to ipc->readdir.req_n entries of directory
+// ipc->readdir.req_fileid, from its seek position on, packed into
+// ipc->readdirRet, and move the seek position past them.  Returns the
+// number of entries, 0 at the end of the directory, or < 0 on error.
+int
+serve_readdir(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsret_readdir *ret = &ipc->readdirRet;
+	struct OpenFile *o;
+	struct Fsdirent *de;
+	struct File *f;
+	uint32_t ent, nent, n, max, len, pos;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_readdir %08x %08x %d\n", envid,
+			ipc->readdir.req_fileid, ipc->readdir.req_n);
+
+	// The entries overwrite the request
+	max = ipc->readdir.req_n;
+	if ((r = openfile_lookup(envid, ipc->readdir.req_fileid, &o)) < 0)
+		return r;
+	if (o->o_file->f_type != FTYPE_DIR || o->o_fd->fd_offset < 0)
+		return -E_INVAL;
+
+	nent = o->o_file->f_size / sizeof(struct File);
+	for (ent = o->o_fd->fd_offset / sizeof(struct File), n = pos = 0;
+	     ent < nent && n < max; ent++) {
+		if ((r = file_find_block(o->o_file, ent / BLKFILES, &blk)) < 0)
+			return r;
+		if (!blk) {
+			ent += BLKFILES - 1 - ent % BLKFILES;
+			continue;
+		}
+		f = (struct File*) blk + ent % BLKFILES;
+		if (f->f_name[0] == '\0')
+			continue;
+		len = ROUNDUP(sizeof(struct Fsdirent) + strlen(f->f_name) + 1,
+			      sizeof(uint32_t));
+		if (pos + len > sizeof(ret->ret_buf))
+			break;
+		de = (struct Fsdirent*) (ret->ret_buf + pos);
+		de->de_size = f->f_size;
+		de->de_isdir = (f->f_type == FTYPE_DIR);
+		de->de_reclen = len;
+		strcpy(de->de_name, f->f_name);
+		pos += len;
+		n++;
+	}
+	o->o_fd->fd_offset = ent * sizeof(struct File);
+	ret->ret_offset = o->o_fd->fd_offset;
+	ret->ret_n = n;
+	return n;
+}
+
+// Stat each of the ipc->stat_paths.req_n paths in ipc->stat_paths,
+// returning the results in ipc->stat_pathsRet.  Returns the number of
+// paths done, which is short only if the request is malformed.
+int
+serve_stat_paths(envid_t envid, union Fsipc *ipc)
+{
+	// The results overwrite the paths, so copy them, off the stack
+	// (see serve_open)
+	const size_t size = sizeof(ipc->stat_paths.req_paths);
+	struct Fsret_path_stat *st = ipc->stat_pathsRet.ret_st;
+	struct File *f;
+	const char *name;
+	uint32_t i, n;
+	char *paths, *p;
+
+	if (debug)
+		cprintf("serve_stat_paths %08x %d\n", envid, ipc->stat_paths.req_n);
+
+	if ((paths = malloc(size)) == NULL)
+		return -E_NO_MEM;
+	n = MIN(ipc->stat_paths.req_n, STAT_PATHS_MAX);
+	memmove(paths, ipc->stat_paths.req_paths, size);
+	paths[size - 1] = '\0';
+	for (i = 0, p = paths; i < n && p < paths + size; i++) {
+		st[i].ret_gen = 0;
+		if ((name = tmpfs_name(p)) != NULL)
+			st[i].ret_r = tmp_stat(name, &st[i].ret_size,
+					       &st[i].ret_isdir);
+		else if ((st[i].ret_r = file_open(p, &f)) == 0) {
+			st[i].ret_size = f->f_size;
+			st[i].ret_isdir = (f->f_type == FTYPE_DIR);
+			st[i].ret_gen = file_gen(f);
+		}
+		p += strlen(p) + 1;
+	}
+	free(paths);
+	return i;
+}
+
+// Open a file of the tmpfs.  Replies like serve_open, with the Fd
+// page, then sends the file's TmpHdr page, read-only.  The open-file
+// entry holds the file's tmpfs ID and the mode, so write access goes
+// with the descriptor, wherever it is passed on.
+static void
+serve_tmp_open(envid_t envid, struct Fsreq_open *req)
+{
+	struct OpenFile *o;
+	const char *name;
+	int omode, id, r;
+	void *hdr;
+
+	if (debug)
+		cprintf("serve_tmp_open %08x %s 0x%x\n", envid, req->req_path,
+			req->req_omode);
+
+	omode = req->req_omode;
+	req->req_path[MAXPATHLEN - 1] = '\0';
+	if ((name = tmpfs_name(req->req_path)) == NULL) {
+		r = -E_INVAL;
+		goto error;
+	}
+	if ((r = tmp_open(name, omode, &hdr)) < 0)
+		goto error;
+	id = r;
+	if ((r = openfile_alloc(&o)) < 0)
+		goto error;
+	o->o_file = NULL;
+	o->o_tmpid = id;
+	o->o_mode = omode;
+	o->o_fd->fd_file.id = o->o_fileid;
+	o->o_fd->fd_omode = omode & O_ACCMODE;
+	o->o_fd->fd_dev_id = devtmp.dev_id;
+
+	if (serve_send(envid, 0, o->o_fd, PTE_P|PTE_U|PTE_W|PTE_SHARE) < 0)
+		return;
+	serve_send(envid, 0, hdr, PTE_P|PTE_U|PTE_SHARE);
+	return;
+
+error:
+	serve_send(envid, r, 0, 0);
+}
+
+// Share the pages holding req->req_len bytes of tmpfs file
+// req->req_fileid, from byte req->req_offset, with the caller.  Replies
+// like serve_map_blocks, but stops at the last page the file has
+// rather than at its size.  The pages are writable only if the file
+// was opened for writing.
+static void
+serve_tmp_map(envid_t envid, struct Fsreq_map_blocks *req)
+{
+	uint32_t pageno, npages;
+	struct OpenFile *o;
+	void *pg;
+	size_t n;
+	int r, perm;
+
+	if (debug)
+		cprintf("serve_tmp_map %08x %08x %08x %08x\n", envid,
+			req->req_fileid, req->req_offset, req->req_len);
+
+	if ((r = openfile_lookup_tmp(envid, req->req_fileid, 0, &o)) < 0)
+		goto error;
+	perm = PTE_P|PTE_U|PTE_SHARE;
+	if ((o->o_mode & O_ACCMODE) != O_RDONLY)
+		perm |= PTE_W;
+	r = -E_INVAL;
+	if (req->req_offset < 0 || req->req_offset >= TMP_MAXSIZE)
+		goto error;
+	n = MIN(req->req_len, TMP_MAXSIZE - ROUNDDOWN(req->req_offset, PGSIZE));
+	for (npages = 0; npages < (PGOFF(req->req_offset) + n + PGSIZE - 1) / PGSIZE; npages++)
+		if (tmp_map(o->o_tmpid, req->req_offset / PGSIZE + npages,
+			    &pg) < 0)
+			break;
+	if (npages == 0)
+		goto error;
+	n = MIN(n, npages * PGSIZE - PGOFF(req->req_offset));
+	if (serve_send(envid, n, 0, 0) < 0)
+		return;
+
+	for (pageno = req->req_offset / PGSIZE; npages-- > 0; pageno++) {
+		tmp_map(o->o_tmpid, pageno, &pg);
+		if (serve_send(envid, 0, pg, perm) < 0)
+			return;
+	}
+	return;
+
+error:
+	serve_send(envid, r, 0, 0);
+}
+
+int
+serve_tmp_set_size(envid_t envid, union Fsipc *ipc)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_tmp_set_size %08x %08x %08x\n", envid,
+			ipc->set_size.req_fileid, ipc->set_size.req_size);
+
+	if ((r = openfile_lookup_tmp(envid, ipc->set_size.req_fileid, 1, &o)) < 0)
+		return r;
+	return tmp_set_size(o->o_tmpid, ipc->set_size.req_size);
+}
+
+int
+serve_tmp_extend(envid_t envid, union Fsipc *ipc)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_tmp_extend %08x %08x %08x\n", envid,
+			ipc->set_size.req_fileid, ipc->set_size.req_size);
+
+	if ((r = openfile_lookup_tmp(envid, ipc->set_size.req_fileid, 1, &o)) < 0)
+		return r;
+	return tmp_extend(o->o_tmpid, ipc->set_size.req_size);
+}
+
+int
+serve_tmp_readdir(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_tmp_readdir %08x %d %d\n", envid,
+			ipc->tmp_readdir.req_offset, ipc->tmp_readdir.req_n);
+
+	return tmp_readdir(ipc->tmp_readdir.req_offset, ipc->tmp_readdir.req_n,
+			   &ipc->readdirRet);
+}
+
+// Remove ipc->remove.req_path.  Only files of the tmpfs can be
+// removed so far.
+int
+serve_remove(envid_t envid, union Fsipc *ipc)
+{
+	const char *name;
+
+	if (debug)
+		cprintf("serve_remove %08x %s\n", envid, ipc->remove.req_path);
+
+	ipc->remove.req_path[MAXPATHLEN - 1] = '\0';
+	if ((name = tmpfs_name(ipc->remove.req_path)) == NULL)
+		return -E_NOT_SUPP;
+	return tmp_remove(name);
+}
+
 // Flush all data and metadata of req->req_fileid to disk.
 int
 serve_flush(envid_t envid, struct Fsreq_flush *req)
@@ -295,16 +894,210 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
-	file_flush(o->o_file);
+	// Writes may have landed since the open changed the generation
+	if (o->o_mode & O_ACCMODE)
+		file_touch(o->o_file);
+	return file_flush(o->o_file);
+}
+
+
+// Stands in for the blocks of file holes in read-only mappings
+static char zero_page[PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// Share the block cache pages holding req->req_len bytes of
+// req->req_fileid, starting at byte req->req_offset, with the caller,
+// read-only unless req->req_write is set.  The first reply is the number of bytes mapped, cut short
+// at the end of the file and at PTSIZE (which is all the room a client
+// has at fd2data), or an error.  Then each page follows in its own
+// reply.  Every env that maps the same block gets the same physical
+// page, so no file data is copied.  If the caller stops receiving the
+// rest are dropped.
+static void
+serve_map_blocks(envid_t envid, struct Fsreq_map_blocks *req)
+{
+	struct OpenFile *o;
+	uint32_t bno, nblocks;
+	size_t n;
+	char *blk;
+	int r, perm;
+
+	if (debug)
+		cprintf("serve_map_blocks %08x %08x %08x %08x\n", envid,
+			req->req_fileid, req->req_offset, req->req_len);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		goto error;
+	r = -E_INVAL;
+	if ((o->o_mode & O_ACCMODE) == O_WRONLY)
+		goto error;
+	perm = PTE_P|PTE_U;
+	if (req->req_write) {
+		if ((o->o_mode & O_ACCMODE) == O_RDONLY)
+			goto error;
+		// Shared, so that a fork of the client does not make its
+		// writes copy-on-write and keep them from the file
+		perm |= PTE_W|PTE_SHARE;
+	}
+	if (req->req_offset < 0 || req->req_offset >= o->o_file->f_size)
+		goto error;
+
+	n = MIN(req->req_len, o->o_file->f_size - req->req_offset);
+	n = MIN(n, PTSIZE - PGOFF(req->req_offset));
+	if (serve_send(envid, n, 0, 0) < 0)
+		return;
+
+	// A read-only mapping of a hole gets the shared page of zeros;
+	// only a writable one needs a block of its own.
+	nblocks = (PGOFF(req->req_offset) + n + BLKSIZE - 1) / BLKSIZE;
+	for (bno = req->req_offset / BLKSIZE; nblocks-- > 0; bno++) {
+		if (req->req_write)
+			r = file_get_block(o->o_file, bno, &blk);
+		else if ((r = file_find_block(o->o_file, bno, &blk)) == 0 && !blk)
+			blk = zero_page;
+		if (r < 0)
+			goto error;
+		if (serve_send(envid, 0, blk, perm) < 0)
+			return;
+	}
+	return;
+
+error:
+	serve_send(envid, r, 0, 0);
+}
+
+// A client wrote to blocks of req->req_fileid that it mapped writable.
+// Only the client's page table saw those writes, so touch each block to
+// mark it dirty here too, then write the file back.
+int
+serve_dirty(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_dirty *req = &ipc->dirty;
+	struct OpenFile *o;
+	off_t end;
+	uint32_t bno;
+	volatile char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_dirty %08x %08x %08x %08x\n", envid,
+			req->req_fileid, req->req_offset, req->req_len);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_RDONLY || req->req_offset < 0)
+		return -E_INVAL;
+
+	end = MIN(req->req_offset + req->req_len, o->o_file->f_size);
+	for (bno = req->req_offset / BLKSIZE; bno * BLKSIZE < end; bno++) {
+		if ((r = file_get_block(o->o_file, bno, (char**) &blk)) < 0)
+			return r;
+		blk[0] = blk[0];
+	}
+	return file_flush(o->o_file);
+}
+
+// Keep the last page of envid's asynchronous I/O region, like
+// serve_window.
+int
+serve_aio_setup(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_aio_setup %08x %d\n", envid, ipc->window.req_index);
+
+	return window_add(&aio_regions, envid, ipc);
+}
+
+// Hand envid the Fd page of ipc->claim.req_fileid, which it opened
+// through its submission ring, storing the page and permissions to
+// return in *pg_store and *perm_store.
+int
+serve_claim(envid_t envid, union Fsipc *ipc, void **pg_store, int *perm_store)
+{
+	uint32_t fileid = ipc->claim.req_fileid;
+	struct OpenFile *o;
+
+	if (debug)
+		cprintf("serve_claim %08x %08x\n", envid, fileid);
+
+	if (fileid % MAXOPEN >= nopen)
+		return -E_INVAL;
+	o = openfile(fileid % MAXOPEN);
+	if (o->o_fileid != fileid || o->o_claim != envid || o->o_free)
+		return -E_INVAL;
+	o->o_claim = 0;
+	*pg_store = o->o_fd;
+	*perm_store = PTE_P|PTE_U|PTE_W|PTE_SHARE;
 	return 0;
 }
 
+// Return the file server's statistics in ipc->statsRet.
+int
+serve_stats(envid_t envid, union Fsipc *ipc)
+{
+	ipc->statsRet = fs_stats;
+	return 0;
+}
 
 int
 serve_sync(envid_t envid, union Fsipc *req)
 {
-	fs_sync();
-	return 0;
+	return fs_sync();
+}
+
+// Let other requests run until *addr is no longer 'val', or a while.
+// Outside request threads, and in bc_pgfault, which runs on the
+// exception stack and so cannot switch threads, just yield the CPU.
+void
+serve_wait(volatile uint32_t *addr, uint32_t val)
+{
+	if (serving && !bc_faulting)
+		thread_wait(addr, val, (uint32_t) ~0);
+	else
+		sys_yield();
+}
+
+// Wake the requests waiting on *addr.
+void
+serve_wakeup(volatile uint32_t *addr)
+{
+	thread_wakeup(addr);
+}
+
+static void
+fs_lock(int mode)
+{
+	if (mode == FS_READ) {
+		while (fs_writing)
+			thread_wait(&fs_writing, 1, (uint32_t) ~0);
+		fs_readers++;
+		return;
+	}
+	while (fs_busy)
+		thread_wait(&fs_busy, 1, (uint32_t) ~0);
+	fs_busy = 1;
+	if (mode == FS_WRITE) {
+		fs_writing = 1;
+		while (fs_readers)
+			thread_wait(&fs_readers, fs_readers, (uint32_t) ~0);
+		// No update is under way, so the journal can commit here
+		journal_begin(JOURNAL_OPBLOCKS);
+	}
+}
+
+static void
+fs_unlock(int mode)
+{
+	if (mode == FS_READ) {
+		fs_readers--;
+		thread_wakeup(&fs_readers);
+		return;
+	}
+	if (mode == FS_WRITE) {
+		fs_writing = 0;
+		thread_wakeup(&fs_writing);
+	}
+	fs_busy = 0;
+	thread_wakeup(&fs_busy);
 }
 
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
@@ -317,45 +1110,276 @@ fshandler handlers[] = {
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_STATS] =		serve_stats,
+	[FSREQ_WINDOW] =	serve_window,
+	[FSREQ_READ_WINDOW] =	serve_read_window,
+	[FSREQ_WRITE_WINDOW] =	serve_write_window,
+	[FSREQ_DIRTY] =		serve_dirty,
+	[FSREQ_AIO_SETUP] =	serve_aio_setup,
+	[FSREQ_READDIR] =	serve_readdir,
+	[FSREQ_STAT_PATHS] =	serve_stat_paths,
+	[FSREQ_REMOVE] =	serve_remove,
+	[FSREQ_TMP_SET_SIZE] =	serve_tmp_set_size,
+	[FSREQ_TMP_READDIR] =	serve_tmp_readdir,
+	[FSREQ_TMP_EXTEND] =	serve_tmp_extend
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// Does request 'req', with arguments 'ipc', leave the file system as
+// it is?  Path lookups do: only creating a file builds an index.
+static bool
+req_reads(uint32_t req, union Fsipc *ipc)
+{
+	if (req == FSREQ_OPEN)
+		return !open_writes(ipc->open.req_omode);
+	// A writable mapping may fill holes
+	if (req == FSREQ_MAP_BLOCKS)
+		return !ipc->map_blocks.req_write;
+	return req == FSREQ_READ || req == FSREQ_STAT || req == FSREQ_STATS
+		|| req == FSREQ_WINDOW || req == FSREQ_READ_WINDOW
+		|| req == FSREQ_AIO_SETUP || req == FSREQ_CLAIM
+		|| req == FSREQ_READDIR || req == FSREQ_STAT_PATHS
+		|| req == FSREQ_TMP_MAP || req == FSREQ_TMP_READDIR;
+}
+
+static void serve_aio(envid_t envid);
+
+// Carry out one entry of a submission ring, then post its result on
+// the completion ring, if the region still belongs to the same env.
+static void
+serve_aio_thread(uint32_t arg)
+{
+	struct AioArgs *args = (struct AioArgs*) arg;
+	struct AioSqe *sqe = &args->sqe;
+	char *va = (char*) (AIOVA + args->region * AIO_SIZE);
+	struct AioRing *ring = (struct AioRing*) va;
+	union Fsipc *data;
+	struct OpenFile *o;
+	int mode, perm, r;
+	void *pg;
+
+	if (debug)
+		cprintf("serve_aio_thread %08x %d %d %08x\n", args->whom,
+			sqe->sqe_op, sqe->sqe_slot, sqe->sqe_fileid);
+
+	data = (union Fsipc*) (va + (1 + sqe->sqe_slot % AIO_NSLOTS) * PGSIZE);
+	mode = req_reads(sqe->sqe_op, data) ? FS_READ : FS_WRITE;
+	fs_lock(mode);
+	if (sqe->sqe_offset < 0)
+		r = -E_INVAL;
+	else if (sqe->sqe_op == FSREQ_OPEN) {
+		if ((r = serve_open(args->whom, &data->open, &pg, &perm)) == 0) {
+			o = openfile(((struct Fd*) pg)->fd_file.id % MAXOPEN);
+			o->o_claim = args->whom;
+			r = o->o_fileid;
+		}
+	} else if (sqe->sqe_op == FSREQ_READ || sqe->sqe_op == FSREQ_WRITE) {
+		if ((r = openfile_lookup(args->whom, sqe->sqe_fileid, &o)) < 0)
+			/* do nothing */;
+		else if (sqe->sqe_op == FSREQ_READ)
+			r = file_read(o->o_file, data, MIN(sqe->sqe_n, PGSIZE),
+				      sqe->sqe_offset);
+		else
+			r = file_write(o->o_file, data, MIN(sqe->sqe_n, PGSIZE),
+				       sqe->sqe_offset);
+	} else if (sqe->sqe_op == FSREQ_STAT) {
+		data->stat.req_fileid = sqe->sqe_fileid;
+		r = serve_stat(args->whom, data);
+	} else
+		r = -E_INVAL;
+	fs_unlock(mode);
+
+	if (window_lookup(&aio_regions, args->whom) == va) {
+		ring->ar_cq[ring->ar_cq_tail % AIO_NSLOTS].cqe_slot = sqe->sqe_slot;
+		ring->ar_cq[ring->ar_cq_tail % AIO_NSLOTS].cqe_result = r;
+		ring->ar_cq_tail++;
+	}
+	aio_inflight[args->region]--;
+	serve_aio(args->whom);
+	free(args);
+}
+
+// Start a thread for each entry on envid's submission ring.
+static void
+serve_aio(envid_t envid)
+{
+	struct AioRing *ring;
+	struct AioArgs *args;
+	uint32_t region;
+
+	if ((ring = (struct AioRing*) window_lookup(&aio_regions, envid)) == NULL)
+		return;
+	region = ((uintptr_t) ring - AIOVA) / AIO_SIZE;
+
+	while (aio_inflight[region] < AIO_NSLOTS) {
+		// The client checks for an empty ring after filling an
+		// entry, and we check for a new entry after emptying it.
+		__sync_synchronize();
+		if (ring->ar_sq_head == ring->ar_sq_tail)
+			break;
+		if ((args = malloc(sizeof(struct AioArgs))) == NULL)
+			panic("could not allocate thread args structure");
+		args->whom = envid;
+		args->region = region;
+		args->sqe = ring->ar_sq[ring->ar_sq_head % AIO_NSLOTS];
+		ring->ar_sq_head++;
+		aio_inflight[region]++;
+		if (thread_create(0, "serve_aio_thread", serve_aio_thread,
+				  (uint32_t) args) < 0)
+			panic("could not create request thread");
+	}
+}
+
+static void
+serve_thread(uint32_t arg)
+{
+	struct ServeArgs *args = (struct ServeArgs*) arg;
+	union Fsipc *ipc = args->ipc;
+	int mode, perm, r;
+	void *pg;
+
+	// Periodic background write-back
+	if (args->req == FSREQ_TIMER) {
+		fs_lock(FS_SYNC);
+		if ((r = fs_sync()) < 0)
+			cprintf("fs: background write-back: %e\n", r);
+		fs_unlock(FS_SYNC);
+		free(args);
+		return;
+	}
+
+	// The client's submission ring has entries
+	if (args->req == FSREQ_AIO) {
+		serve_aio(args->whom);
+		free(args);
+		return;
+	}
+
+	mode = req_reads(args->req, ipc) ? FS_READ : FS_WRITE;
+	fs_lock(mode);
+	pg = NULL;
+	perm = args->perm;
+	if (args->req == FSREQ_OPEN) {
+		r = serve_open(args->whom, (struct Fsreq_open*)ipc, &pg, &perm);
+	} else if (args->req == FSREQ_CLAIM) {
+		r = serve_claim(args->whom, ipc, &pg, &perm);
+	} else if (args->req == FSREQ_TMP_OPEN) {
+		// Sends its own replies
+		serve_tmp_open(args->whom, &ipc->open);
+		goto done;
+	} else if (args->req == FSREQ_TMP_MAP) {
+		// Sends its own replies
+		serve_tmp_map(args->whom, &ipc->map_blocks);
+		goto done;
+	} else if (args->req == FSREQ_MAP_BLOCKS) {
+		// Sends its own replies
+		serve_map_blocks(args->whom, &ipc->map_blocks);
+		goto done;
+	} else if (args->req < NHANDLERS && handlers[args->req]) {
+		r = handlers[args->req](args->whom, ipc);
+	} else {
+		cprintf("Invalid request code %d from %08x\n", args->req,
+			args->whom);
+		r = -E_INVAL;
+	}
+	serve_send(args->whom, r, pg, perm);
+
+done:
+	fs_unlock(mode);
+	sys_page_unmap(0, ipc);
+	req_busy &= ~(1 << (((uintptr_t) ipc - REQVA) / PGSIZE));
+	req_nfree++;
+	thread_wakeup(&req_nfree);
+	free(args);
+}
+
 void
 serve(void)
 {
+	struct ServeArgs *args;
+	struct Windows *ws;
 	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	int i, perm;
+	union Fsipc *ipc;
 
+	serving = 1;
 	while (1) {
+		// ipc_recv will block the entire env, so first run every
+		// request that can get on.  Those left are waiting for the
+		// disk, and the timer env wakes us when it is done.
+		while (thread_wakeups_pending())
+			thread_yield();
+
+		while (req_nfree == 0)
+			thread_wait(&req_nfree, 0, (uint32_t) ~0);
+		for (i = 0; req_busy & (1 << i); i++)
+			/* do nothing */;
+		ipc = (union Fsipc*) (REQVA + i * PGSIZE);
+
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		req = ipc_recv((int32_t *) &whom, ipc, &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, uvpt[PGNUM(fsreq)], fsreq);
+				req, whom, uvpt[PGNUM(ipc)], ipc);
 
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		// A disk transfer has ended
+		if (req == FSREQ_WAKE && whom == timer_envid) {
+			ide_poll();
+			continue;
+		}
+
+		// A region's pages are kept as they arrive, in order, and
+		// only the last one is answered, by its request thread
+		if ((ws = window_table(req)) != NULL && (perm & PTE_P)
+		    && ipc->window.req_index + 1 < ws->ws_npages) {
+			window_add(ws, whom, ipc);
+			sys_page_unmap(0, ipc);
+			continue;
+		}
+
+		// Write-back and doorbells take no request slot, so drop any
+		// page they carry.  Only the timer env may ask for write-back.
+		if (req == FSREQ_TIMER || req == FSREQ_AIO) {
+			if (perm & PTE_P)
+				sys_page_unmap(0, ipc);
+			perm = 0;
+			if (req == FSREQ_TIMER && whom != timer_envid) {
+				cprintf("Invalid request from %08x: write-back not from the timer\n",
+					whom);
+				continue;
+			}
+		}
+
+		// All other requests must contain an argument page
+		if (!(perm & PTE_P) && req != FSREQ_TIMER && req != FSREQ_AIO) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
+		if ((args = malloc(sizeof(struct ServeArgs))) == NULL)
+			panic("could not allocate thread args structure");
+		args->whom = whom;
+		args->req = req;
+		args->perm = perm;
+		args->ipc = ipc;
+		if (perm & PTE_P) {
+			req_busy |= 1 << i;
+			req_nfree--;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		if (thread_create(0, "serve_thread", serve_thread, (uint32_t) args) < 0)
+			panic("could not create request thread");
+		thread_yield(); // let the thread created run
 	}
 }
 
+static void
+tmain(uint32_t arg)
+{
+	serve();
+}
+
 void
 umain(int argc, char **argv)
 {
@@ -368,7 +1392,27 @@ umain(int argc, char **argv)
 	cprintf("FS can do I/O\n");
 
 	serve_init();
+	ide_share();
+
+	// Fork off the timer env which will send us periodic write-back
+	// requests, and tell us when DMA transfers end.  Do it before
+	// fs_init, while no disk blocks are mapped to be made
+	// copy-on-write.
+	if ((timer_envid = fork()) < 0)
+		panic("error forking");
+	else if (timer_envid == 0) {
+		timer(thisenv->env_parent_id, BC_FLUSH_MSEC);
+		return;
+	}
+
 	fs_init();
-	serve();
+	fs_test();
+
+	// Start the thread library and continue in a thread, which
+	// serves each request in a thread of its own.
+	thread_init();
+	thread_create(0, "main", tmain, 0);
+	thread_yield();
+	// never coming here!
 }
 
@@ -5,6 +5,151 @@
 
 static char *msg = "This is the NEW message of the day!\n\n";
 
+static char buf[BLKSIZE];
+
+// The number of the block holding 'va'.
+static uint32_t
+blockof(void *va)
+{
+	return ((uint32_t) va - DISKMAP) / BLKSIZE;
+}
+
+// Is f's inode safe, or on its way?  Without a journal that means
+// written back; with one, logged in the running transaction.
+static bool
+inode_pending(struct File *f)
+{
+	if (journal_on())
+		return journal_busy(blockof(f));
+	return !(uvpt[PGNUM(f)] & PTE_D);
+}
+
+// Open 'path', creating it first if an earlier boot did not.
+static struct File *
+test_file(const char *path, bool isdir)
+{
+	struct File *f;
+	int r;
+
+	// Like a request, an update reserves its room in the journal
+	journal_begin(JOURNAL_OPBLOCKS);
+	if ((r = file_open(path, &f)) == -E_NOT_FOUND
+	    && (r = file_create(path, &f)) == 0 && isdir) {
+		f->f_type = FTYPE_DIR;
+		journal_add(f);
+	}
+	if (r < 0)
+		panic("test_file %s: %e", path, r);
+	return f;
+}
+
+// Blocks a file writes get disk blocks only when it is flushed, then
+// in one extent.  Past NDIRECT + NINDIRECT blocks, the double-indirect
+// block comes in, and truncation frees it again.
+static void
+delayed_test(void)
+{
+	struct File *f;
+	uint32_t i, dind;
+	int r;
+
+	f = test_file("/fstest-big", 0);
+	if ((r = file_set_size(f, 0)) < 0)
+		panic("file_set_size: %e", r);
+	for (i = 0; i < 4; i++) {
+		memset(buf, 'a' + i, BLKSIZE);
+		if ((r = file_write(f, buf, BLKSIZE, i * BLKSIZE)) != BLKSIZE)
+			panic("file_write: %e", r);
+	}
+	assert(f->f_direct[0] == 0);
+	if ((r = file_read(f, buf, BLKSIZE, 2 * BLKSIZE)) != BLKSIZE)
+		panic("file_read: %e", r);
+	assert(buf[0] == 'c' && buf[BLKSIZE - 1] == 'c');
+	file_flush(f);
+	for (i = 0; i < 4; i++) {
+		assert(f->f_direct[i] && !block_is_free(f->f_direct[i]));
+		assert(i == 0 || f->f_direct[i] == f->f_direct[i - 1] + 1);
+	}
+	cprintf("delayed allocation is good\n");
+
+	if (super->s_version < 1)
+		return;
+	memset(buf, 'z', BLKSIZE);
+	if ((r = file_write(f, buf, BLKSIZE, (NDIRECT + NINDIRECT) * BLKSIZE))
+	    != BLKSIZE)
+		panic("file_write double-indirect: %e", r);
+	file_flush(f);
+	assert(f->f_indirect == 0 && f->f_dindirect != 0);
+	dind = f->f_dindirect;
+	memset(buf, 0, BLKSIZE);
+	if ((r = file_read(f, buf, BLKSIZE, (NDIRECT + NINDIRECT) * BLKSIZE))
+	    != BLKSIZE)
+		panic("file_read double-indirect: %e", r);
+	assert(buf[0] == 'z' && buf[BLKSIZE - 1] == 'z');
+	if ((r = file_set_size(f, 4 * BLKSIZE)) < 0)
+		panic("file_set_size double-indirect: %e", r);
+	assert(f->f_dindirect == 0 && block_is_free(dind));
+	assert(f->f_direct[3] != 0);
+	if ((r = file_set_size(f, 0)) < 0)
+		panic("file_set_size: %e", r);
+	file_flush(f);
+	cprintf("double-indirect file is good\n");
+}
+
+// A directory that outgrows DIRHASH_MINBLOCKS gets a hash index, and
+// every name is still found through it.
+static void
+dirindex_test(void)
+{
+	char path[MAXPATHLEN];
+	struct File *dir, *f;
+	int i, r;
+
+	if (super->s_version < 2)
+		return;
+	dir = test_file("/fstest", 1);
+	for (i = 0; i < 3 * BLKFILES; i++) {
+		snprintf(path, sizeof(path), "/fstest/f%d", i);
+		test_file(path, 0);
+	}
+	assert(dir->f_dirindex != 0);
+	for (i = 0; i < 3 * BLKFILES; i++) {
+		snprintf(path, sizeof(path), "/fstest/f%d", i);
+		if ((r = file_open(path, &f)) < 0)
+			panic("file_open %s: %e", path, r);
+		assert(strcmp(f->f_name, path + strlen("/fstest/")) == 0);
+	}
+	if ((r = file_open("/fstest/missing", &f)) != -E_NOT_FOUND)
+		panic("file_open /fstest/missing: %e", r);
+	cprintf("directory index is good\n");
+}
+
+// Recovery replays the last committed transaction.  Commit a change
+// to f, drop the cached block before it goes home, and check that
+// replaying the journal brings the change back.
+static void
+replay_test(struct File *f)
+{
+	off_t size = f->f_size;
+	int r;
+
+	if (!journal_on())
+		return;
+	journal_commit();
+	if ((r = file_set_size(f, size + BLKSIZE)) < 0)
+		panic("file_set_size: %e", r);
+	journal_commit();
+	assert(uvpt[PGNUM(f)] & PTE_D);
+	if ((r = sys_page_unmap(0, ROUNDDOWN(f, BLKSIZE))) < 0)
+		panic("sys_page_unmap: %e", r);
+	journal_init();
+	assert(f->f_size == size + BLKSIZE);
+	if ((r = file_set_size(f, size)) < 0)
+		panic("file_set_size: %e", r);
+	file_flush(f);
+	cprintf("journal replay is good\n");
+}
+
 void
 fs_test(void)
 {
@@ -25,6 +170,7 @@ fs_test(void)
 	assert(bits[r/32] & (1 << (r%32)));
 	// and is not free any more
 	assert(!(bitmap[r/32] & (1 << (r%32))));
+	free_block(r);
 	cprintf("alloc_block is good\n");
 
 	if ((r = file_open("/not-found", &f)) < 0 && r != -E_NOT_FOUND)
@@ -50,18 +196,23 @@ fs_test(void)
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %e", r);
 	assert(f->f_direct[0] == 0);
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
+	assert(inode_pending(f));
 	cprintf("file_truncate is good\n");
 
 	if ((r = file_set_size(f, strlen(msg))) < 0)
 		panic("file_set_size 2: %e", r);
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		panic("file_get_block 2: %e", r);
 	strcpy(blk, msg);
 	assert((uvpt[PGNUM(blk)] & PTE_D));
 	file_flush(f);
 	assert(!(uvpt[PGNUM(blk)] & PTE_D));
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
+	// With a journal, f is committed and goes home later
+	assert(journal_on() ? !journal_busy(blockof(f))
+			    : !(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file rewrite is good\n");
+
+	replay_test(f);
+	delayed_test();
+	dirindex_test();
 }
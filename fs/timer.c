@@ -0,0 +1,31 @@
+#include "fs.h"
+
+// Body of the env the file server forks at startup: every 'msec'
+// milliseconds, ask the server to write back its dirty blocks.
+// Meanwhile, watch the disk: the server may be asleep in ipc_recv with
+// requests waiting on a DMA transfer, and no interrupt will tell it
+// that the transfer has ended.
+void
+timer(envid_t fs_envid, uint32_t msec)
+{
+	int r;
+	uint32_t stop, seq, woken = 0;
+
+	binaryname = "fs_timer";
+
+	while (1) {
+		stop = sys_time_msec() + msec;
+		while ((r = sys_time_msec()) < stop && r >= 0) {
+			seq = ide_dma_seq();
+			if (seq != woken && ide_dma_ended()) {
+				woken = seq;
+				ipc_send(fs_envid, FSREQ_WAKE, 0, 0);
+			}
+			sys_yield();
+		}
+		if (r < 0)
+			panic("sys_time_msec: %e", r);
+
+		ipc_send(fs_envid, FSREQ_TIMER, 0, 0);
+	}
+}
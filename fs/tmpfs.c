@@ -0,0 +1,279 @@
+#include "fs.h"
+
+// The tmpfs (see struct TmpHdr).  File i lives at TMPFSVA + i * PTSIZE:
+// its TmpHdr page, then its data pages, as the clients map them at
+// fd2data.  A file exists if its TmpHdr page is mapped.  Pages are
+// never taken away from a file until it is removed, so a client that
+// has mapped one never has to check that it is still current;
+// shrinking a file just clears the bytes past the end.
+//
+// Clients get the TmpHdr page read-only, and the server goes only by
+// its own struct TmpFile, which it copies into the TmpHdr after each
+// change.  Opens go through the open-file table like other files (see
+// serve_tmp_open), which decides what a descriptor may do.
+//
+// A file's ID is its slot plus TMP_NFILES times the number of files
+// that used the slot before it, so an env cannot get at a new file
+// through the ID of a removed one.  TMP_NFILES is the ID of /tmp.
+#define TMPPERM		(PTE_P|PTE_W|PTE_U|PTE_SHARE)
+
+struct TmpFile {
+	char tf_name[MAXNAMELEN];
+	off_t tf_size;
+	uint32_t tf_npages;		// data pages allocated
+};
+
+static struct TmpFile tmp_files[TMP_NFILES];
+static uint32_t tmp_gen[TMP_NFILES];
+
+// The TmpHdr of /tmp, which clients get read-only
+static union {
+	struct TmpHdr th;
+	char pad[PGSIZE];
+} tmp_root __attribute__((aligned(PGSIZE))) = {
+	.th = { .th_name = "tmp", .th_isdir = 1 }
+};
+
+static struct TmpHdr *
+tmp_hdr(uint32_t slot)
+{
+	static_assert(TMPFSVA + TMP_NFILES * PTSIZE <= TMPFSLIM);
+	return (struct TmpHdr*) (TMPFSVA + slot * PTSIZE);
+}
+
+// Return the address of data page 'pageno' of the file in 'slot'.
+static char *
+tmp_page(uint32_t slot, uint32_t pageno)
+{
+	return (char*) tmp_hdr(slot) + (pageno + 1) * PGSIZE;
+}
+
+// Copy what the clients may know of the file in 'slot' into its TmpHdr.
+static void
+tmp_sync_hdr(uint32_t slot)
+{
+	struct TmpHdr *th = tmp_hdr(slot);
+	struct TmpFile *tf = &tmp_files[slot];
+
+	strcpy(th->th_name, tf->tf_name);
+	th->th_npages = tf->tf_npages;
+	th->th_size = tf->tf_size;
+}
+
+// Find the file 'name' (see tmpfs_name), returning its slot,
+// TMP_NFILES for /tmp itself, or -E_NOT_FOUND.
+static int
+tmp_lookup(const char *name)
+{
+	uint32_t i;
+
+	if (name[0] == '\0')
+		return TMP_NFILES;
+	for (i = 0; i < TMP_NFILES; i++)
+		if (va_is_mapped(tmp_hdr(i))
+		    && strcmp(tmp_files[i].tf_name, name) == 0)
+			return i;
+	return -E_NOT_FOUND;
+}
+
+// Find the file with ID 'id', returning its slot or -E_INVAL.
+static int
+tmp_slot(uint32_t id)
+{
+	uint32_t slot = id % TMP_NFILES;
+
+	if (id == TMP_NFILES)
+		return TMP_NFILES;
+	if (!va_is_mapped(tmp_hdr(slot)) || id / TMP_NFILES != tmp_gen[slot])
+		return -E_INVAL;
+	return slot;
+}
+
+// Set the size of the file in 'slot'.  Growing past the pages the file
+// has gives it twice as many, so that a file written a little at a
+// time asks for pages only now and then.
+static int
+tmp_resize(uint32_t slot, off_t newsize)
+{
+	struct TmpFile *tf = &tmp_files[slot];
+	uint32_t n;
+	int r;
+
+	r = 0;
+	if (newsize > tf->tf_npages * PGSIZE) {
+		n = MAX(ROUNDUP(newsize, PGSIZE) / PGSIZE, 2 * tf->tf_npages);
+		n = MIN(n, TMP_MAXSIZE / PGSIZE);
+		for (; tf->tf_npages < n; tf->tf_npages++)
+			if ((r = sys_page_alloc(0, tmp_page(slot, tf->tf_npages),
+						TMPPERM)) < 0)
+				break;
+		if (newsize > tf->tf_npages * PGSIZE)
+			goto out;
+	}
+	if (newsize < tf->tf_size)
+		memset(tmp_page(slot, 0) + newsize, 0, tf->tf_size - newsize);
+	tf->tf_size = newsize;
+	r = 0;
+out:
+	tmp_sync_hdr(slot);
+	return r;
+}
+
+// Find file 'id' to change, returning its slot or -E_INVAL.
+static int
+tmp_slot_file(uint32_t id)
+{
+	int slot;
+
+	if ((slot = tmp_slot(id)) < 0)
+		return slot;
+	if (slot == TMP_NFILES)
+		return -E_INVAL;
+	return slot;
+}
+
+// Set the size of file 'id'.
+int
+tmp_set_size(uint32_t id, off_t newsize)
+{
+	int slot;
+
+	if ((slot = tmp_slot_file(id)) < 0)
+		return slot;
+	if (newsize < 0 || newsize > TMP_MAXSIZE)
+		return -E_INVAL;
+	return tmp_resize(slot, newsize);
+}
+
+// Grow file 'id' to at least 'size' bytes.  Unlike tmp_set_size, this
+// never cuts off what another env appended since the caller last
+// looked at the size.
+int
+tmp_extend(uint32_t id, off_t size)
+{
+	int slot;
+
+	if ((slot = tmp_slot_file(id)) < 0)
+		return slot;
+	if (size < 0 || size > TMP_MAXSIZE)
+		return -E_INVAL;
+	if (size <= tmp_files[slot].tf_size)
+		return 0;
+	return tmp_resize(slot, size);
+}
+
+// Open the file 'name' of the tmpfs, creating it if 'omode' says so,
+// and set *hdr to its TmpHdr page, which clients get read-only.
+// Returns the file's ID, or < 0 on error.
+int
+tmp_open(const char *name, int omode, void **hdr)
+{
+	int slot, r;
+
+	if (strchr(name, '/') || strlen(name) >= MAXNAMELEN)
+		return -E_BAD_PATH;
+	if (omode & O_MKDIR)
+		return -E_INVAL;
+	if ((slot = tmp_lookup(name)) == TMP_NFILES) {
+		if ((omode & O_ACCMODE) != O_RDONLY)
+			return -E_INVAL;
+		*hdr = &tmp_root;
+		return TMP_NFILES;
+	}
+
+	if (slot >= 0 && (omode & O_CREAT) && (omode & O_EXCL))
+		return -E_FILE_EXISTS;
+	if (slot < 0) {
+		if (!(omode & O_CREAT))
+			return slot;
+		for (slot = 0; slot < TMP_NFILES; slot++)
+			if (!va_is_mapped(tmp_hdr(slot)))
+				break;
+		if (slot == TMP_NFILES)
+			return -E_MAX_OPEN;
+		if ((r = sys_page_alloc(0, tmp_hdr(slot), TMPPERM)) < 0)
+			return r;
+		memset(&tmp_files[slot], 0, sizeof(tmp_files[slot]));
+		strcpy(tmp_files[slot].tf_name, name);
+		tmp_sync_hdr(slot);
+		tmp_gen[slot]++;
+	}
+
+	if ((omode & O_TRUNC) && (omode & O_ACCMODE) != O_RDONLY)
+		tmp_resize(slot, 0);
+	*hdr = tmp_hdr(slot);
+	return slot + TMP_NFILES * tmp_gen[slot];
+}
+
+// Set *pg to data page 'pageno' of file 'id'.
+int
+tmp_map(uint32_t id, uint32_t pageno, void **pg)
+{
+	int slot;
+
+	if ((slot = tmp_slot(id)) < 0 || slot == TMP_NFILES
+	    || pageno >= tmp_files[slot].tf_npages)
+		return -E_INVAL;
+	*pg = tmp_page(slot, pageno);
+	return 0;
+}
+
+// Look up 'name', setting *size and *isdir.
+int
+tmp_stat(const char *name, off_t *size, int *isdir)
+{
+	int slot;
+
+	if ((slot = tmp_lookup(name)) < 0)
+		return slot;
+	*size = slot == TMP_NFILES ? 0 : tmp_files[slot].tf_size;
+	*isdir = slot == TMP_NFILES;
+	return 0;
+}
+
+// Remove the file 'name'.  Envs that have it open keep its pages.
+int
+tmp_remove(const char *name)
+{
+	uint32_t i;
+	int slot;
+
+	if ((slot = tmp_lookup(name)) < 0)
+		return slot;
+	if (slot == TMP_NFILES)
+		return -E_INVAL;
+	for (i = 0; i < tmp_files[slot].tf_npages; i++)
+		sys_page_unmap(0, tmp_page(slot, i));
+	sys_page_unmap(0, tmp_hdr(slot));
+	return 0;
+}
+
+// List the tmpfs into 'ret' like serve_readdir, starting at slot
+// 'offset', with at most 'max' entries.
+int
+tmp_readdir(off_t offset, uint32_t max, struct Fsret_readdir *ret)
+{
+	struct Fsdirent *de;
+	uint32_t n, len, pos;
+	struct TmpFile *tf;
+
+	for (n = pos = 0; offset >= 0 && offset < TMP_NFILES && n < max; offset++) {
+		if (!va_is_mapped(tmp_hdr(offset)))
+			continue;
+		tf = &tmp_files[offset];
+		len = ROUNDUP(sizeof(struct Fsdirent) + strlen(tf->tf_name) + 1,
+			      sizeof(uint32_t));
+		if (pos + len > sizeof(ret->ret_buf))
+			break;
+		de = (struct Fsdirent*) (ret->ret_buf + pos);
+		de->de_size = tf->tf_size;
+		de->de_isdir = 0;
+		de->de_reclen = len;
+		strcpy(de->de_name, tf->tf_name);
+		pos += len;
+		n++;
+	}
+	ret->ret_offset = offset;
+	ret->ret_n = n;
+	return n;
+}
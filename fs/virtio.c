@@ -0,0 +1,363 @@
+/*
+ * virtio-blk driver, for when QEMU gives the file system disk to a
+ * virtio block device rather than to the IDE controller.  It uses the
+ * legacy (virtio 0.9) PCI interface, which is all I/O ports, so the
+ * server needs nothing from the kernel beyond its I/O privilege.
+ *
+ * Unlike the IDE channel, the device takes many requests at once:
+ * each is a chain of descriptors (a header, one descriptor per page of
+ * data, and a status byte) on a single virtqueue, and up to VIO_NREQ
+ * may be in flight.  As with IDE DMA, completions are noticed by
+ * polling the used ring, here or in the timer env (see ide_dma_ended);
+ * the device is told not to interrupt.
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+// Legacy virtio PCI registers, relative to the I/O port in BAR 0
+#define VIO_DEVFEAT	0x00	// device features
+#define VIO_DRVFEAT	0x04	// driver features
+#define VIO_QPFN	0x08	// physical page of the selected queue
+#define VIO_QSIZE	0x0C	// entries in the selected queue
+#define VIO_QSEL	0x0E
+#define VIO_QNOTIFY	0x10
+#define VIO_STATUS	0x12
+#define VIO_CAPACITY	0x14	// disk size in sectors, 64 bits
+
+#define VIO_STATUS_ACK		0x01
+#define VIO_STATUS_DRIVER	0x02
+#define VIO_STATUS_DRIVER_OK	0x04
+
+#define VIRTIO_BLK_T_IN		0	// read
+#define VIRTIO_BLK_T_OUT	1	// write
+
+struct VringDesc {
+	uint64_t vd_addr;
+	uint32_t vd_len;
+	uint16_t vd_flags;
+	uint16_t vd_next;
+};
+#define VRING_DESC_F_NEXT	1
+#define VRING_DESC_F_WRITE	2	// the device writes the buffer
+
+struct VringAvail {
+	uint16_t va_flags;
+	volatile uint16_t va_idx;
+	uint16_t va_ring[];
+};
+#define VRING_AVAIL_F_NO_INTERRUPT	1
+
+struct VringUsed {
+	uint16_t vu_flags;
+	volatile uint16_t vu_idx;
+	struct {
+		uint32_t id;	// head of the finished chain
+		uint32_t len;
+	} vu_ring[];
+};
+
+// The queue must be physically contiguous, and mapped in the timer env
+// too, so it is set up before the timer is forked.  VIO_SCRATCHVA is
+// where virtio_contig looks for adjacent physical pages.
+#define VIO_QMAXPAGES	8
+#define VIO_NSCRATCH	64
+
+static uint16_t vio_port;
+static uint32_t vio_qsize;
+static struct VringDesc *vio_desc;
+static struct VringAvail *vio_avail;
+static struct VringUsed *vio_used;
+
+// Descriptors not in use, linked through vd_next
+static uint16_t vio_free;
+static uint32_t vio_nfree;
+
+// Requests in flight.  The headers and status bytes are read and
+// written by the device, so they sit in a page of their own.
+#define VIO_NREQ	16
+
+struct VioReq {
+	struct {
+		uint32_t type;
+		uint32_t reserved;
+		uint64_t sector;
+	} vr_hdr;
+	uint8_t vr_status;
+	uint16_t vr_head;		// first descriptor of the chain
+	int vr_bounce;			// bounce buffer, -1 if none
+	volatile int *vr_result;	// NULL if the slot is free
+};
+
+static struct VioReq vio_reqs[VIO_NREQ] __attribute__((aligned(PGSIZE)));
+
+// Writes go out of a copy of the data, as for IDE DMA (see dma_buf).
+#define VIO_NBOUNCE	4
+static char vio_bounce[VIO_NBOUNCE][BC_MAXRUN * BLKSIZE]
+	__attribute__((aligned(PGSIZE)));
+static uint32_t vio_bounce_busy;
+
+static volatile uint32_t vio_ndone;	// requests finished
+
+static bool
+virtio_match(uint32_t id, uint32_t class)
+{
+	// Red Hat, transitional virtio block device
+	return id == 0x10011AF4;
+}
+
+// The kernel hands out pages one at a time, so find 'n' physically
+// adjacent ones among a batch of fresh pages, and map them in order at
+// 'va'.  Returns 0 on success, < 0 on error.
+static int
+virtio_contig(char *va, uint32_t n)
+{
+	physaddr_t pa[VIO_NSCRATCH];
+	uint32_t i, j, k, start;
+	int r;
+
+	for (i = 0; i < VIO_NSCRATCH; i++) {
+		if ((r = sys_page_alloc(0, (char*) VIO_SCRATCHVA + i * PGSIZE,
+					PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+			return r;
+		pa[i] = PTE_ADDR(uvpt[PGNUM(VIO_SCRATCHVA + i * PGSIZE)]);
+	}
+
+	r = -E_NO_MEM;
+	for (start = 0; start < VIO_NSCRATCH && r < 0; start++) {
+		for (k = 1; k < n; k++) {
+			for (j = 0; j < VIO_NSCRATCH; j++)
+				if (pa[j] == pa[start] + k * PGSIZE)
+					break;
+			if (j == VIO_NSCRATCH)
+				break;
+		}
+		if (k < n)
+			continue;
+		for (k = 0; k < n; k++)
+			for (j = 0; j < VIO_NSCRATCH; j++)
+				if (pa[j] == pa[start] + k * PGSIZE
+				    && (r = sys_page_map(0, (char*) VIO_SCRATCHVA + j * PGSIZE,
+							 0, va + k * PGSIZE,
+							 PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+					return r;
+		r = 0;
+	}
+
+	for (i = 0; i < VIO_NSCRATCH; i++)
+		sys_page_unmap(0, (char*) VIO_SCRATCHVA + i * PGSIZE);
+	return r;
+}
+
+// Look for a virtio block device and set up its queue.  Call before
+// forking the timer env, which watches the queue's used ring.
+// Returns 0 if there is a device to use, < 0 otherwise.
+int
+virtio_init(void)
+{
+	uint32_t tag, bar, usedoff, npages, i;
+	int r;
+
+	if (pci_find(virtio_match, &tag) < 0)
+		return -E_NOT_FOUND;
+	bar = pci_conf_read(tag, PCI_BAR(0));
+	if (!(bar & 1))
+		return -E_NOT_SUPP;
+	pci_conf_write(tag, PCI_COMMAND_STATUS_REG,
+		       pci_conf_read(tag, PCI_COMMAND_STATUS_REG)
+		       | PCI_COMMAND_IO_ENABLE | PCI_COMMAND_MASTER_ENABLE);
+	vio_port = bar & 0xFFFC;
+
+	// Reset, then say we know how to drive it.  We need no features.
+	outb(vio_port + VIO_STATUS, 0);
+	outb(vio_port + VIO_STATUS, VIO_STATUS_ACK);
+	outb(vio_port + VIO_STATUS, VIO_STATUS_ACK | VIO_STATUS_DRIVER);
+	outl(vio_port + VIO_DRVFEAT, 0);
+
+	// The legacy interface fixes the queue size and layout: the
+	// descriptors, then the available ring, then the used ring on the
+	// next page.
+	outw(vio_port + VIO_QSEL, 0);
+	vio_qsize = inw(vio_port + VIO_QSIZE);
+	usedoff = ROUNDUP(vio_qsize * sizeof(struct VringDesc)
+			  + sizeof(struct VringAvail) + (vio_qsize + 1) * 2, PGSIZE);
+	npages = (usedoff + ROUNDUP(sizeof(struct VringUsed)
+				    + vio_qsize * 8 + 2, PGSIZE)) / PGSIZE;
+	if (vio_qsize == 0 || npages > VIO_QMAXPAGES) {
+		r = -E_NOT_SUPP;
+		goto fail;
+	}
+	if ((r = virtio_contig((char*) VIO_QVA, npages)) < 0)
+		goto fail;
+
+	vio_desc = (struct VringDesc*) VIO_QVA;
+	vio_avail = (struct VringAvail*) (VIO_QVA + vio_qsize * sizeof(struct VringDesc));
+	vio_used = (struct VringUsed*) (VIO_QVA + usedoff);
+	vio_avail->va_flags = VRING_AVAIL_F_NO_INTERRUPT;
+	for (i = 0; i < vio_qsize; i++)
+		vio_desc[i].vd_next = i + 1;
+	vio_free = 0;
+	vio_nfree = vio_qsize;
+
+	outl(vio_port + VIO_QPFN, PTE_ADDR(uvpt[PGNUM(VIO_QVA)]) / PGSIZE);
+	outb(vio_port + VIO_STATUS, VIO_STATUS_ACK | VIO_STATUS_DRIVER
+	     | VIO_STATUS_DRIVER_OK);
+
+	ide_shared->is_vioport = vio_port;
+	ide_shared->is_vio_used = &vio_used->vu_idx;
+	cprintf("virtio-blk: port %04x, %d queue entries, %d sectors\n",
+		vio_port, vio_qsize, inl(vio_port + VIO_CAPACITY));
+	return 0;
+
+fail:
+	outb(vio_port + VIO_STATUS, 0);
+	cprintf("virtio-blk: cannot use device at port %04x: %e\n", vio_port, r);
+	vio_port = 0;
+	return r;
+}
+
+// Take the requests that the device has finished off the used ring,
+// and hand each its result.
+void
+virtio_poll(void)
+{
+	struct VioReq *vr;
+	uint16_t seen = ide_shared->is_vio_seen, d;
+
+	if (seen == vio_used->vu_idx)
+		return;
+	while (seen != vio_used->vu_idx) {
+		__sync_synchronize();
+		d = vio_used->vu_ring[seen % vio_qsize].id;
+		for (vr = vio_reqs; vr < vio_reqs + VIO_NREQ; vr++)
+			if (vr->vr_result && vr->vr_head == d)
+				break;
+		if (vr == vio_reqs + VIO_NREQ)
+			panic("virtio-blk: unknown request %d finished", d);
+
+		// Put the chain back on the free list
+		vio_nfree++;
+		while (vio_desc[d].vd_flags & VRING_DESC_F_NEXT) {
+			d = vio_desc[d].vd_next;
+			vio_nfree++;
+		}
+		vio_desc[d].vd_next = vio_free;
+		vio_free = vr->vr_head;
+
+		if (vr->vr_bounce >= 0)
+			vio_bounce_busy &= ~(1 << vr->vr_bounce);
+		*vr->vr_result = vr->vr_status == 0 ? 0 : -1;
+		vr->vr_result = NULL;
+		seen++;
+	}
+	ide_shared->is_vio_seen = seen;
+	vio_ndone++;
+	serve_wakeup(&vio_ndone);
+}
+
+// Wait for a while for requests in flight to finish.
+static void
+virtio_wait(void)
+{
+	uint32_t ndone = vio_ndone;
+
+	virtio_poll();
+	if (vio_ndone == ndone)
+		serve_wait(&vio_ndone, ndone);
+}
+
+// Take a free descriptor for 'len' bytes at physical address 'pa'.
+static uint16_t
+virtio_desc(uint64_t pa, uint32_t len, uint16_t flags)
+{
+	uint16_t d = vio_free;
+
+	vio_free = vio_desc[d].vd_next;
+	vio_nfree--;
+	vio_desc[d].vd_addr = pa;
+	vio_desc[d].vd_len = len;
+	vio_desc[d].vd_flags = flags;
+	return d;
+}
+
+// Transfer 'nsecs' sectors starting at 'secno' between the disk and
+// 'buf', waiting for a request slot, enough descriptors and, for a
+// write, a bounce buffer.  Other requests run meanwhile, and keep the
+// device busy with theirs.  Returns 0 on success, < 0 on error.
+int
+virtio_rw(uint32_t secno, const void *buf, size_t nsecs, bool to_mem)
+{
+	volatile int result = 1;
+	size_t len = nsecs * SECTSIZE, n;
+	uint16_t d, prev;
+	struct VioReq *vr;
+	const char *p;
+	pte_t pte;
+	int b;
+
+	if (len > sizeof(vio_bounce[0]))
+		return -E_INVAL;
+
+	// The data takes a descriptor per page it touches
+	while (1) {
+		for (vr = vio_reqs; vr < vio_reqs + VIO_NREQ; vr++)
+			if (!vr->vr_result)
+				break;
+		for (b = 0; b < VIO_NBOUNCE; b++)
+			if (!(vio_bounce_busy & (1 << b)))
+				break;
+		if (vr < vio_reqs + VIO_NREQ && (to_mem || b < VIO_NBOUNCE)
+		    && vio_nfree >= 2 + len / PGSIZE + 1)
+			break;
+		virtio_wait();
+	}
+	vr->vr_bounce = -1;
+	if (!to_mem) {
+		vio_bounce_busy |= 1 << b;
+		vr->vr_bounce = b;
+		memmove(vio_bounce[b], buf, len);
+		buf = vio_bounce[b];
+	}
+
+	// Check the buffer before taking any descriptors.  A page the
+	// device writes must be mapped writable: DMA bypasses the MMU.
+	for (p = buf; p < (const char*) buf + len; p += n) {
+		n = MIN(len - (p - (const char*) buf), PGSIZE - PGOFF(p));
+		if (!(uvpd[PDX(p)] & PTE_P) || !(uvpt[PGNUM(p)] & PTE_P)
+		    || (to_mem && !(uvpt[PGNUM(p)] & PTE_W))) {
+			if (vr->vr_bounce >= 0)
+				vio_bounce_busy &= ~(1 << vr->vr_bounce);
+			return -E_INVAL;
+		}
+	}
+
+	vr->vr_hdr.type = to_mem ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT;
+	vr->vr_hdr.reserved = 0;
+	vr->vr_hdr.sector = secno;
+	vr->vr_status = 0xFF;
+	pte = uvpt[PGNUM(vr)];
+	vr->vr_head = prev = virtio_desc(PTE_ADDR(pte) | PGOFF(&vr->vr_hdr),
+					 sizeof(vr->vr_hdr), VRING_DESC_F_NEXT);
+	for (p = buf; p < (const char*) buf + len; p += n) {
+		n = MIN(len - (p - (const char*) buf), PGSIZE - PGOFF(p));
+		d = virtio_desc(PTE_ADDR(uvpt[PGNUM(p)]) | PGOFF(p), n,
+				VRING_DESC_F_NEXT | (to_mem ? VRING_DESC_F_WRITE : 0));
+		vio_desc[prev].vd_next = d;
+		prev = d;
+	}
+	d = virtio_desc(PTE_ADDR(pte) | PGOFF(&vr->vr_status), 1,
+			VRING_DESC_F_WRITE);
+	vio_desc[prev].vd_next = d;
+	vr->vr_result = &result;
+
+	// Publish the chain, then the new index, then tell the device.
+	vio_avail->va_ring[vio_avail->va_idx % vio_qsize] = vr->vr_head;
+	__sync_synchronize();
+	vio_avail->va_idx++;
+	__sync_synchronize();
+	outw(vio_port + VIO_QNOTIFY, 0);
+
+	while (result == 1)
+		virtio_wait();
+	return result;
+}
@@ -46,22 +46,32 @@ enum EnvType {
 	ENV_TYPE_NS,		// Network server
 };
 
+// The fields the scheduler and envid2env() look at on every pass over
+// envs[] come first, next to each other, ahead of the saved registers,
+// IPC state and sending queue.  Field names are unchanged, so user
+// code reading envs[] through UENVS keeps working after a rebuild.
 struct Env {
-	struct Trapframe env_tf;	// Saved registers
-	struct Env *env_link;		// Next free Env
-	envid_t env_id;			// Unique environment identifier
-	envid_t env_parent_id;		// env_id of this env's parent
-	enum EnvType env_type;		// Indicates special system environments
+	// Scheduler-hot fields
 	unsigned env_status;		// Status of the environment
+	envid_t env_id;			// Unique environment identifier
+	struct Env *env_link;		// Next free Env
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
+	enum EnvType env_type;		// Indicates special system environments
+	envid_t env_parent_id;		// env_id of this env's parent
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
+	struct Trapframe env_tf;	// Saved registers
+
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
 
+	// FPU/SSE state, switched in env_run
+	void *env_fpu;			// Kernel VA of FXSAVE area, or NULL
+	int env_fpu_cpu;		// CPU whose registers hold it, or -1
+
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
 	void *env_ipc_dstva;		// VA at which to map received page
@@ -47,6 +47,7 @@ struct Stat {
 	char st_name[MAXNAMELEN];
 	off_t st_size;
 	int st_isdir;
+	uint32_t st_gen;	// changes when the file is opened for writing
 	struct Dev *st_dev;
 };
 
@@ -61,5 +62,6 @@ extern struct Dev devfile;
 extern struct Dev devsock;
 extern struct Dev devcons;
 extern struct Dev devpipe;
+extern struct Dev devtmp;
 
 #endif	// not JOS_INC_FD_H
@@ -23,8 +23,13 @@
 #define NDIRECT		10
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
+// Number of blocks reachable through the double-indirect block
+#define NDINDIRECT	(NINDIRECT * NINDIRECT)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// Number of block pointers a File can address in all
+#define MAXFILEBLOCKS	(NDIRECT + NINDIRECT + NDINDIRECT)
+// The double-indirect block reaches past what a (signed) off_t can hold
+#define MAXFILESIZE	0x7FFFF000
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
@@ -35,10 +40,15 @@ struct File {
 	// A block is allocated iff its value is != 0.
 	uint32_t f_direct[NDIRECT];	// direct blocks
 	uint32_t f_indirect;		// indirect block
+	uint32_t f_dindirect;		// double-indirect block (FS_VERSION >= 1)
+
+	// Directory hash index (FS_VERSION >= 2).
+	uint32_t f_dirindex;		// this directory's DirIndex block
+	uint32_t f_hnext;		// next entry in the parent's chain
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 16];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -48,15 +58,50 @@ struct File {
 #define FTYPE_REG	0	// Regular file
 #define FTYPE_DIR	1	// Directory
 
+// A directory's hash index.  Entry e of a directory is slot e % BLKFILES
+// of its block e / BLKFILES; chains link entries through f_hnext and
+// hold e + 1, so 0 ends a chain.  The entries themselves are unchanged,
+// so a linear scan of the directory still finds everything.
+#define DIRHASH_NBUCKET	(BLKSIZE / 4 - 1)
+
+struct DirIndex {
+	uint32_t di_free;			// chain of unused entries
+	uint32_t di_bucket[DIRHASH_NBUCKET];	// chains of entries by name
+};
+
 
 // File system super-block (both in-memory and on-disk)
 
 #define FS_MAGIC	0x4A0530AE	// related vaguely to 'J\0S!'
+// On-disk format version.  Images from before s_version existed read
+// as version 0 and have no double-indirect blocks; version 1 images
+// have no directory hash indexes, and version 2 images no journal.
+#define FS_VERSION	3
 
 struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_version;		// On-disk format version: FS_VERSION
+	uint32_t s_jstart;		// First block of the journal
+	uint32_t s_jnblocks;		// Blocks in the journal, 0 if none
+};
+
+// Metadata journal.  fsformat reserves JOURNAL_NBLOCKS blocks; the
+// first holds a JournalHeader and the rest copies of the blocks it
+// lists.  A header whose magic and checksum are right describes a
+// committed transaction, which fs_init replays.
+#define JOURNAL_NBLOCKS	32
+#define JOURNAL_MAGIC	0x4A4E4C21	// 'JNL!'
+#define JOURNAL_MAXBLOCKS	((BLKSIZE - 16) / 4)
+
+struct JournalHeader {
+	uint32_t jh_magic;		// JOURNAL_MAGIC
+	uint32_t jh_seq;		// Transaction sequence number
+	uint32_t jh_nblocks;		// Blocks logged after the header
+	uint32_t jh_sum;		// Checksum of jh_seq, the block
+					// numbers and the logged blocks
+	uint32_t jh_blocknos[JOURNAL_MAXBLOCKS];	// Their home blocks
 };
 
 // Definitions for requests from clients to file system
@@ -70,7 +115,145 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Map_blocks replies with the number of bytes mapped, then sends
+	// each block cache page of that range, read-only, in turn
+	FSREQ_MAP_BLOCKS,
+	// Stats returns a struct FsStats on the request page
+	FSREQ_STATS,
+	// Sent by the file server's own timer env, without a page
+	FSREQ_TIMER,
+	// Window hands the server one page of the client's bulk I/O
+	// window: the request page itself, holding a Fsreq_window.  The
+	// client sends all the pages in order, and only the last one is
+	// answered, with the result for the whole window.
+	FSREQ_WINDOW,
+	// Read_window and write_window move up to FSWINDOW_SIZE bytes
+	// through that window instead of the request page
+	FSREQ_READ_WINDOW,
+	FSREQ_WRITE_WINDOW,
+	// Dirty says that a client wrote to blocks that it mapped writable
+	// with map_blocks, and has them written back
+	FSREQ_DIRTY,
+	// Sent by the timer env too, when a disk transfer that the server
+	// may be waiting for has ended
+	FSREQ_WAKE,
+	// Aio_setup hands the server one page of the client's
+	// asynchronous I/O region, like FSREQ_WINDOW
+	FSREQ_AIO_SETUP,
+	// Aio rings the doorbell: the client's submission ring has
+	// entries.  It carries no page and gets no reply.
+	FSREQ_AIO,
+	// Claim returns the Fd page of a file opened through the
+	// submission ring, which gave the client only its file ID
+	FSREQ_CLAIM,
+	// Readdir returns a Fsret_readdir on the request page: entries of
+	// a directory from its seek position on, which it moves past them
+	FSREQ_READDIR,
+	// Stat_paths returns a Fsret_stat_paths on the request page, one
+	// result for each path in the Fsreq_stat_paths
+	FSREQ_STAT_PATHS,
+	// Tmp_open opens a file of the tmpfs, given a Fsreq_open.  It
+	// replies like open, then sends the file's TmpHdr page.
+	FSREQ_TMP_OPEN,
+	// Tmp_map replies like map_blocks, with pages of a tmpfs file;
+	// req_offset and req_len are in bytes of the file as usual
+	FSREQ_TMP_MAP,
+	FSREQ_TMP_SET_SIZE,
+	// Tmp_readdir lists the tmpfs like readdir, from req_offset
+	FSREQ_TMP_READDIR,
+	// Tmp_extend grows a tmpfs file to at least req_size, given a
+	// Fsreq_set_size, and never shrinks it
+	FSREQ_TMP_EXTEND
+};
+
+// The tmpfs, mounted at /tmp, keeps a flat directory of up to
+// TMP_NFILES files in memory.  The file server owns their pages and
+// shares them (PTE_SHARE) with every env that opens the file: a
+// TmpHdr page, read-only, then the data, writable only if the env
+// opened the file for writing.  An env maps them at fd2data of the
+// file descriptor, and reads and writes them in place, asking the
+// server for pages it has not mapped yet and to grow the file.
+#define TMP_NFILES	32
+#define TMP_MAXSIZE	(PTSIZE - PGSIZE)
+
+struct TmpHdr {
+	char th_name[MAXNAMELEN];
+	volatile off_t th_size;
+	volatile uint32_t th_npages;	// data pages the server has
+	int th_isdir;			// this is /tmp itself
+};
+
+// A directory entry as FSREQ_READDIR returns it.  The name, with its
+// NUL, follows the header, and the next entry starts de_reclen bytes
+// after this one.
+struct Fsdirent {
+	off_t de_size;
+	uint16_t de_isdir;
+	uint16_t de_reclen;
+	char de_name[0];
+};
+
+// Most paths one FSREQ_STAT_PATHS can take
+#define STAT_PATHS_MAX	(PGSIZE / (2 * sizeof(int) + sizeof(off_t) + sizeof(uint32_t)))
+
+// A client's bulk I/O window: pages it shares with the file server
+// (PTE_SHARE) once, so that large reads and writes take one request
+// per FSWINDOW_SIZE bytes rather than one per page.
+#define FSWINDOW_NPAGES	16
+#define FSWINDOW_SIZE	(FSWINDOW_NPAGES * PGSIZE)
+
+// Asynchronous I/O.  A client shares AIO_NPAGES pages with the file
+// server (PTE_SHARE) once: a struct AioRing, then one data page per
+// slot.  It queues requests on the submission ring, and rings the
+// doorbell (FSREQ_AIO) only if the server may have found the ring
+// empty; the server posts each result on the completion ring as soon
+// as it has one.  A client has at most AIO_NSLOTS requests in flight,
+// so neither ring can overflow.
+#define AIO_NSLOTS	16
+#define AIO_NPAGES	(1 + AIO_NSLOTS)
+#define AIO_SIZE	(AIO_NPAGES * PGSIZE)
+
+struct AioSqe {
+	uint32_t sqe_op;	// FSREQ_OPEN, _READ, _WRITE or _STAT
+	uint32_t sqe_slot;	// data page: arguments and results
+	int sqe_fileid;
+	size_t sqe_n;		// bytes to read or write, at most PGSIZE
+	off_t sqe_offset;	// ... from this byte; the seek position
+				// is left alone
+};
+
+struct AioCqe {
+	uint32_t cqe_slot;
+	int cqe_result;		// as for the synchronous request; an
+				// open returns the new file ID
+};
+
+struct AioRing {
+	volatile uint32_t ar_sq_head;	// next entry the server takes
+	volatile uint32_t ar_sq_tail;	// next entry the client fills
+	volatile uint32_t ar_cq_head;	// next entry the client takes
+	volatile uint32_t ar_cq_tail;	// next entry the server fills
+	struct AioSqe ar_sq[AIO_NSLOTS];
+	struct AioCqe ar_cq[AIO_NSLOTS];
+};
+
+// File server statistics
+struct FsStats {
+	uint32_t fs_lookups;		// bc_get calls and block cache faults
+	uint32_t fs_faults;		// ... that missed
+	uint32_t fs_evictions;		// blocks evicted from the cache
+	uint32_t fs_writes;		// disk write commands
+	uint32_t fs_blocks_written;	// ... and the blocks they wrote
+	uint32_t fs_ra_blocks;		// blocks read ahead of a miss
+	uint32_t fs_ra_hits;		// ... and used before the next miss
+	uint32_t fs_ra_window;		// current read-ahead window, in blocks
+	uint32_t fs_name_hits;		// path components found in the name cache
+	uint32_t fs_name_misses;	// ... and looked up in the directory
+	uint32_t fs_commits;		// journal transactions committed
+	uint32_t fs_blocks_logged;	// ... and the blocks they logged
+	uint32_t fs_extents;		// extents given to delayed blocks
+	uint32_t fs_blocks_delayed;	// ... and the blocks in them
 };
 
 union Fsipc {
@@ -101,6 +284,7 @@ union Fsipc {
 		char ret_name[MAXNAMELEN];
 		off_t ret_size;
 		int ret_isdir;
+		uint32_t ret_gen;
 	} statRet;
 	struct Fsreq_flush {
 		int req_fileid;
@@ -108,6 +292,56 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map_blocks {
+		int req_fileid;
+		off_t req_offset;
+		size_t req_len;
+		int req_write;		// map the pages writable
+	} map_blocks;
+	struct Fsreq_dirty {
+		int req_fileid;
+		off_t req_offset;
+		size_t req_len;
+	} dirty;
+	struct Fsreq_window {
+		uint32_t req_index;	// which page of the window (or
+					// asynchronous I/O region) this is
+	} window;
+	struct Fsreq_io {
+		int req_fileid;
+		size_t req_n;
+	} io;
+	struct Fsreq_claim {
+		int req_fileid;
+	} claim;
+	struct Fsreq_readdir {
+		int req_fileid;
+		uint32_t req_n;		// most entries to return
+	} readdir;
+	struct Fsreq_tmp_readdir {
+		off_t req_offset;	// the seek position
+		uint32_t req_n;
+	} tmp_readdir;
+	struct Fsret_readdir {
+		uint32_t ret_n;
+		off_t ret_offset;	// the new seek position
+		char ret_buf[PGSIZE - sizeof(uint32_t) - sizeof(off_t)];
+					// struct Fsdirents
+	} readdirRet;
+	struct Fsreq_stat_paths {
+		uint32_t req_n;
+		char req_paths[PGSIZE - sizeof(uint32_t)];	// back to back,
+								// each with its NUL
+	} stat_paths;
+	struct Fsret_stat_paths {
+		struct Fsret_path_stat {
+			int ret_r;		// 0, or < 0 if the path is bad
+			off_t ret_size;
+			int ret_isdir;
+			uint32_t ret_gen;
+		} ret_st[STAT_PATHS_MAX];
+	} stat_pathsRet;
+	struct FsStats statsRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
@@ -102,10 +102,29 @@ int	fstat(int fd, struct Stat *statbuf);
 int	stat(const char *path, struct Stat *statbuf);
 
 // file.c
+int	fsipc(unsigned type, void *dstva);
 int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	read_map(int fd, off_t offset, void **blk);
+ssize_t	fmap(int fd, off_t offset, size_t len, void **addr);
+int	mmap(int fd, off_t offset, size_t len, int prot, int flags,
+	     void **addr);
+int	msync(void *addr);
+int	munmap(void *addr);
+int	fsstats(struct FsStats *st);
+int	aio_open(const char *path, int mode);
+int	aio_read(int fd, void *buf, size_t n, off_t offset);
+int	aio_write(int fd, const void *buf, size_t n, off_t offset);
+int	aio_stat(int fd, struct Stat *st);
+int	aio_wait(int id);
+int	readdir(int fd, struct Stat *st, int n);
+int	stat_paths(const char **paths, struct Stat *st, int *res, int n);
+
+// tmpfs.c
+const char *tmpfs_name(const char *path);
+int	tmpfs_open(const char *path, int mode);
 
 // pageref.c
 int	pageref(void *addr);
@@ -133,6 +152,8 @@ int     nsipc_socket(int domain, int type, int protocol);
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
 envid_t	spawnl(const char *program, const char *arg0, ...);
+void	zygote_serve(void (*main)(int argc, char **argv))
+		__attribute__((noreturn));
 
 // console.c
 void	cputchar(int c);
@@ -158,4 +179,11 @@ void	wait(envid_t env);
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
 
+/* mmap protections and flags */
+#define	PROT_READ	0x1		/* pages can be read */
+#define	PROT_WRITE	0x2		/* pages can be written */
+
+#define	MAP_SHARED	0x1		/* writes go to the file */
+#define	MAP_PRIVATE	0x2		/* writes stay in this environment */
+
 #endif	// !JOS_INC_LIB_H
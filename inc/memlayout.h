@@ -137,6 +137,14 @@
 #define PFTEMP		(UTEMP + PTSIZE - PGSIZE)
 // The location of the user-level STABS data structure
 #define USTABDATA	(PTSIZE / 2)
+// Where spawn maps the shared libjos image (see lib/libjos.ld)
+#define LIBJOSVA	0xE1000000
+// The library's fixed regions use [0xE0000000, 0xE5000000): the zygote
+// registry, libjos, the file window, mmap's Fds and the aio rings.
+// The file server keeps the tmpfs's files above them, at TMPFSVA, one
+// PTSIZE slot each, up to TMPFSLIM (see fs/tmpfs.c).
+#define TMPFSVA		0xE5000000
+#define TMPFSLIM	0xED000000
 
 // Physical address of startup code for non-boot CPUs (APs)
 #define MPENTRY_PADDR	0x7000
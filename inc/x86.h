@@ -27,6 +27,9 @@ static __inline void lcr3(uint32_t val) __attribute__((always_inline));
 static __inline uint32_t rcr3(void) __attribute__((always_inline));
 static __inline void lcr4(uint32_t val) __attribute__((always_inline));
 static __inline uint32_t rcr4(void) __attribute__((always_inline));
+static __inline void clts(void) __attribute__((always_inline));
+static __inline void fxsave(void *area) __attribute__((always_inline));
+static __inline void fxrstor(const void *area) __attribute__((always_inline));
 static __inline void tlbflush(void) __attribute__((always_inline));
 static __inline uint32_t read_eflags(void) __attribute__((always_inline));
 static __inline void write_eflags(uint32_t eflags) __attribute__((always_inline));
@@ -217,6 +220,24 @@ rcr4(void)
 	return cr4;
 }
 
+static __inline void
+clts(void)
+{
+	__asm __volatile("clts");
+}
+
+static __inline void
+fxsave(void *area)
+{
+	__asm __volatile("fxsave %0" : "=m" (*(uint8_t (*)[512]) area));
+}
+
+static __inline void
+fxrstor(const void *area)
+{
+	__asm __volatile("fxrstor %0" : : "m" (*(const uint8_t (*)[512]) area));
+}
+
 static __inline void
 tlbflush(void)
 {
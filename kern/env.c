@@ -122,6 +122,7 @@ env_init(void)
     env_free_list = envs;
     envs[0].env_id = 0;
     envs[0].env_status = ENV_FREE;
+    envs[0].env_fpu = NULL;
 
     int i = 0;
     for (i = 1 ; i < NENV ; i++)
@@ -129,6 +130,7 @@ env_init(void)
         envs[i - 1].env_link = &envs[i];
         envs[i].env_id = 0;
         envs[i].env_status = ENV_FREE;
+        envs[i].env_fpu = NULL;
     }
 
     envs[NENV - 1].env_link = NULL;
@@ -155,6 +157,13 @@ env_init_percpu(void)
 	// For good measure, clear the local descriptor table (LDT),
 	// since we don't use it.
 	lldt(0);
+
+	// Let user environments use the x87 FPU and SSE.  FPU state is
+	// switched in env_run.  CR0_TS stays clear: trap_dispatch has no
+	// T_DEVICE handler, so a trapping FPU instruction would kill the env.
+	lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	lcr0((rcr0() | CR0_MP | CR0_NE) & ~(CR0_EM | CR0_TS));
+	thiscpu->cpu_fpu_env = NULL;
 }
 
 //
@@ -205,6 +214,25 @@ env_setup_vm(struct Env *e)
 	return 0;
 }
 
+//
+// Allocate e's FPU save area, holding the power-on defaults: all x87
+// and SSE exceptions masked.
+// Returns 0 on success, -E_NO_MEM if there is no free page.
+//
+static int
+env_fpu_alloc(struct Env *e)
+{
+	struct PageInfo *pp;
+
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	pp->pp_ref++;
+	e->env_fpu = page2kva(pp);
+	*(uint16_t *) e->env_fpu = 0x037F;		// FCW
+	*(uint32_t *) ((uint8_t *) e->env_fpu + 24) = 0x1F80;	// MXCSR
+	return 0;
+}
+
 //
 // Allocates and initializes a new environment.
 // On success, the new environment is stored in *newenv_store.
@@ -223,9 +251,15 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	if (!(e = env_free_list))
 		return -E_NO_FREE_ENV;
 
-	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	// Allocate the FPU save area and the page directory for this
+	// environment.
+	if ((r = env_fpu_alloc(e)) < 0)
 		return r;
+	if ((r = env_setup_vm(e)) < 0) {
+		page_decref(pa2page(PADDR(e->env_fpu)));
+		e->env_fpu = NULL;
+		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -267,6 +301,9 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
 
+	// No CPU's registers hold the new FPU state yet.
+	e->env_fpu_cpu = -1;
+
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
@@ -499,6 +536,13 @@ env_free(struct Env *e)
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
 
+	// free the FPU save area
+	if (e->env_fpu) {
+		page_decref(pa2page(PADDR(e->env_fpu)));
+		e->env_fpu = NULL;
+	}
+	e->env_fpu_cpu = -1;
+
 	// return the environment to the free list
 	e->env_status = ENV_FREE;
 	e->env_link = env_free_list;
@@ -552,6 +596,24 @@ env_pop_tf(struct Trapframe *tf)
 	panic("iret failed");  /* mostly to placate the compiler */
 }
 
+//
+// Save the FPU state that this CPU's registers hold into its env's save
+// area, if they still hold the current state of a live env.  Must be
+// called whenever that env leaves this CPU: env_run does so on a
+// switch, and sched_halt must do so before it clears curenv, or an env
+// that blocked here and resumes on another CPU gets stale state.  The
+// registers are left as they are, so the env skips the restore if it
+// next runs here.
+//
+void
+env_fpu_save(void)
+{
+	struct Env *owner = thiscpu->cpu_fpu_env;
+
+	if (owner && owner->env_fpu && owner->env_fpu_cpu == cpunum())
+		fxsave(owner->env_fpu);
+}
+
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
@@ -586,6 +648,17 @@ env_run(struct Env *e)
             curenv->env_status = ENV_RUNNABLE;
         }
     }
+
+    // Switch FPU state: save the state this CPU's registers hold, which
+    // is still the last env's even if the CPU halted since, and load the
+    // incoming env's unless the registers already hold it.
+    if (thiscpu->cpu_fpu_env != e || e->env_fpu_cpu != cpunum())
+    {
+        env_fpu_save();
+        fxrstor(e->env_fpu);
+        thiscpu->cpu_fpu_env = e;
+        e->env_fpu_cpu = cpunum();
+    }
     curenv = e;
     curenv->env_status = ENV_RUNNING;
     curenv->env_runs++;
@@ -129,6 +129,7 @@ static struct Dev *devtab[] =
 	&devsock,
 	&devpipe,
 	&devcons,
+	&devtmp,
 	0
 };
 
@@ -303,19 +304,19 @@ fstat(int fdnum, struct Stat *stat)
 	stat->st_name[0] = 0;
 	stat->st_size = 0;
 	stat->st_isdir = 0;
+	stat->st_gen = 0;
 	stat->st_dev = dev;
 	return (*dev->dev_stat)(fd, stat);
 }
 
+// One FSREQ_STAT_PATHS request, rather than an open, a stat and a close
 int
 stat(const char *path, struct Stat *stat)
 {
-	int fd, r;
+	int r, res;
 
-	if ((fd = open(path, O_RDONLY)) < 0)
-		return fd;
-	r = fstat(fd, stat);
-	close(fd);
-	return r;
+	if ((r = stat_paths(&path, stat, &res, 1)) < 0)
+		return r;
+	return res;
 }
 
@@ -6,28 +6,93 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Where this environment's bulk I/O window lives (see FSREQ_WINDOW)
+#define FSWINDOWVA	0xE2000000
+
+// Where this environment's asynchronous I/O region lives
+#define AIOVA		0xE4000000
+
+static envid_t
+fsenv(void)
+{
+	static envid_t envid;
+	if (envid == 0)
+		envid = ipc_find_env(ENV_TYPE_FS);
+	return envid;
+}
+
+// Send request page 'pg' to the file server with permissions 'perm',
+// and wait for a reply.
+static int
+fsipc_page(unsigned type, void *pg, int perm, void *dstva)
+{
+	if (debug)
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)pg);
+
+	ipc_send(fsenv(), type, pg, perm);
+	return ipc_recv(NULL, dstva, NULL);
+}
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
 // type: request code, passed as the simple integer IPC value.
 // dstva: virtual address at which to receive reply page, 0 if none.
 // Returns result from the file server.
-static int
+int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
-
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
-	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+	return fsipc_page(type, &fsipcbuf, PTE_P | PTE_W | PTE_U, dstva);
+}
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+// The env whose window is mapped at FSWINDOWVA.  The pages are
+// PTE_SHARE, so a forked or spawned child sees its parent's window
+// there, and has to replace it with its own.
+static envid_t fswindow_owner;
+
+// Share the 'npages' pages at 'va' with the file server as one region,
+// with request 'type' (FSREQ_WINDOW or FSREQ_AIO_SETUP).  The server
+// answers only the last page, so this is a single round trip.
+// Returns 0 on success, < 0 on error.
+static int
+fsipc_region(unsigned type, char *va, uint32_t npages)
+{
+	uint32_t i;
+	int r;
+
+	for (i = 0; i < npages; i++) {
+		if ((r = sys_page_alloc(0, va + i * PGSIZE,
+					PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+			return r;
+		((struct Fsreq_window*) (va + i * PGSIZE))->req_index = i;
+	}
+	for (i = 0; i + 1 < npages; i++)
+		ipc_send(fsenv(), type, va + i * PGSIZE,
+			 PTE_P|PTE_W|PTE_U|PTE_SHARE);
+	return fsipc_page(type, va + i * PGSIZE,
+			  PTE_P|PTE_W|PTE_U|PTE_SHARE, NULL);
+}
+
+// Set up this environment's bulk I/O window with the file server,
+// unless that is already done.  Returns 0 on success, < 0 on error.
+static int
+fswindow(void)
+{
+	int r;
+
+	if (fswindow_owner == thisenv->env_id)
+		return 0;
+
+	if ((r = fsipc_region(FSREQ_WINDOW, (char*) FSWINDOWVA,
+			      FSWINDOW_NPAGES)) < 0)
+		return r;
+	fswindow_owner = thisenv->env_id;
+	return 0;
 }
 
+static int devfile_close(struct Fd *fd);
 static int devfile_flush(struct Fd *fd);
 static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
@@ -39,7 +104,7 @@ struct Dev devfile =
 	.dev_id =	'f',
 	.dev_name =	"file",
 	.dev_read =	devfile_read,
-	.dev_close =	devfile_flush,
+	.dev_close =	devfile_close,
 	.dev_stat =	devfile_stat,
 	.dev_write =	devfile_write,
 	.dev_trunc =	devfile_trunc
@@ -73,6 +138,8 @@ open(const char *path, int mode)
 
 	if (strlen(path) >= MAXPATHLEN)
 		return -E_BAD_PATH;
+	if (tmpfs_name(path))
+		return tmpfs_open(path, mode);
 
 	if ((r = fd_alloc(&fd)) < 0)
 		return r;
@@ -103,7 +170,47 @@ devfile_flush(struct Fd *fd)
 	return fsipc(FSREQ_FLUSH, NULL);
 }
 
+// Unmap whatever fmap left at fd2data(fd).
+static void
+devfile_unmap(struct Fd *fd)
+{
+	char *va = fd2data(fd), *end = va + PTSIZE;
+
+	for (; va < end; va += PGSIZE)
+		if ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P))
+			sys_page_unmap(0, va);
+}
+
+// Drop the pages mapped by fmap, if any, and flush the file.
+static int
+devfile_close(struct Fd *fd)
+{
+	devfile_unmap(fd);
+	return devfile_flush(fd);
+}
+
+// Move up to FSWINDOW_SIZE bytes of 'n' through the window with a
+// FSREQ_READ_WINDOW or FSREQ_WRITE_WINDOW request.  Returns the result
+// of the request, or -E_NOT_FOUND if there is no window to use, in
+// which case the caller should go a page at a time.
+static int
+fswindow_io(unsigned type, struct Fd *fd, size_t n)
+{
+	int r;
+
+	if (fswindow() < 0)
+		return -E_NOT_FOUND;
+	fsipcbuf.io.req_fileid = fd->fd_file.id;
+	fsipcbuf.io.req_n = MIN(n, FSWINDOW_SIZE);
+	// The server drops windows when it runs out of room for them
+	if ((r = fsipc(type, NULL)) == -E_NOT_FOUND)
+		fswindow_owner = 0;
+	return r;
+}
+
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
+// Reads of more than a page go through the bulk I/O window, as few
+// requests as it takes, stopping early at the end of the file.
 //
 // Returns:
 // 	The number of bytes successfully read.
@@ -116,19 +223,36 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
 	int r;
+	size_t tot, m;
 
-	fsipcbuf.read.req_fileid = fd->fd_file.id;
-	fsipcbuf.read.req_n = n;
-	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
-		return r;
-	assert(r <= n);
-	assert(r <= PGSIZE);
-	memmove(buf, fsipcbuf.readRet.ret_buf, r);
-	return r;
+	for (tot = 0; tot < n; tot += r) {
+		m = MIN(n - tot, FSWINDOW_SIZE);
+		if (m > PGSIZE
+		    && (r = fswindow_io(FSREQ_READ_WINDOW, fd, m)) != -E_NOT_FOUND) {
+			if (r < 0)
+				return tot ? tot : r;
+			assert(r <= m);
+			memmove(buf + tot, (void*) FSWINDOWVA, r);
+		} else {
+			m = MIN(m, PGSIZE);
+			fsipcbuf.read.req_fileid = fd->fd_file.id;
+			fsipcbuf.read.req_n = m;
+			if ((r = fsipc(FSREQ_READ, NULL)) < 0)
+				return tot ? tot : r;
+			assert(r <= m);
+			memmove(buf + tot, fsipcbuf.readRet.ret_buf, r);
+		}
+		if (r < m) {
+			tot += r;
+			break;
+		}
+	}
+	return tot;
 }
 
 
 // Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
+// Like devfile_read, large writes go through the bulk I/O window.
 //
 // Returns:
 //	 The number of bytes successfully written.
@@ -142,12 +266,30 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// bytes than requested.
 	// LAB 5: Your code here
     int r;
+    size_t tot, m;
 
-    fsipcbuf.write.req_fileid = fd->fd_file.id;
-    fsipcbuf.write.req_n = MIN(n, sizeof(fsipcbuf.write.req_buf));
-    memmove(fsipcbuf.write.req_buf, buf, fsipcbuf.write.req_n);
-
-    return fsipc(FSREQ_WRITE, NULL);
+    for (tot = 0; tot < n; tot += r) {
+        m = MIN(n - tot, FSWINDOW_SIZE);
+        if (m > sizeof(fsipcbuf.write.req_buf) && fswindow() == 0) {
+            memmove((void*) FSWINDOWVA, buf + tot, m);
+            r = fswindow_io(FSREQ_WRITE_WINDOW, fd, m);
+        } else
+            r = -E_NOT_FOUND;
+        if (r == -E_NOT_FOUND) {
+            m = MIN(m, sizeof(fsipcbuf.write.req_buf));
+            fsipcbuf.write.req_fileid = fd->fd_file.id;
+            fsipcbuf.write.req_n = m;
+            memmove(fsipcbuf.write.req_buf, buf + tot, m);
+            r = fsipc(FSREQ_WRITE, NULL);
+        }
+        if (r < 0)
+            return tot ? tot : r;
+        if (r < m) {
+            tot += r;
+            break;
+        }
+    }
+    return tot;
 }
 
 static int
@@ -161,6 +303,7 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 	strcpy(st->st_name, fsipcbuf.statRet.ret_name);
 	st->st_size = fsipcbuf.statRet.ret_size;
 	st->st_isdir = fsipcbuf.statRet.ret_isdir;
+	st->st_gen = fsipcbuf.statRet.ret_gen;
 	return 0;
 }
 
@@ -173,6 +316,636 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 	return fsipc(FSREQ_SET_SIZE, NULL);
 }
 
+// Read up to 'n' entries of directory 'fdnum', from its seek position
+// on, into 'st', and move the seek position past them.  Each request
+// returns as many entries as fit in a page.
+//
+// Returns the number of entries read, 0 at the end of the directory,
+// or < 0 on error.
+int
+readdir(int fdnum, struct Stat *st, int n)
+{
+	struct Fsdirent *de;
+	struct Fd *fd;
+	int i, r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (n < 0)
+		return -E_INVAL;
+
+	if (fd->fd_dev_id == devtmp.dev_id) {
+		if (!((struct TmpHdr*) fd2data(fd))->th_isdir)
+			return -E_INVAL;
+		fsipcbuf.tmp_readdir.req_offset = fd->fd_offset;
+		fsipcbuf.tmp_readdir.req_n = n;
+		if ((r = fsipc(FSREQ_TMP_READDIR, NULL)) < 0)
+			return r;
+		fd->fd_offset = fsipcbuf.readdirRet.ret_offset;
+	} else if (fd->fd_dev_id == devfile.dev_id) {
+		fsipcbuf.readdir.req_fileid = fd->fd_file.id;
+		fsipcbuf.readdir.req_n = n;
+		if ((r = fsipc(FSREQ_READDIR, NULL)) < 0)
+			return r;
+	} else
+		return -E_INVAL;
+
+	de = (struct Fsdirent*) fsipcbuf.readdirRet.ret_buf;
+	for (i = 0; i < r; i++) {
+		strcpy(st[i].st_name, de->de_name);
+		st[i].st_size = de->de_size;
+		st[i].st_isdir = de->de_isdir;
+		st[i].st_dev = fd->fd_dev_id == devtmp.dev_id ? &devtmp : &devfile;
+		de = (struct Fsdirent*) ((char*) de + de->de_reclen);
+	}
+	return r;
+}
+
+// Copy the last element of 'path' into 'name', which is "/" for the root.
+static void
+path_name(const char *path, char *name)
+{
+	const char *end = path + strlen(path), *p;
+
+	while (end > path && end[-1] == '/')
+		end--;
+	for (p = end; p > path && p[-1] != '/'; p--)
+		/* do nothing */;
+	if (p == end)
+		strcpy(name, "/");
+	else {
+		memmove(name, p, MIN(end - p, MAXNAMELEN - 1));
+		name[MIN(end - p, MAXNAMELEN - 1)] = '\0';
+	}
+}
+
+// Stat each of the 'n' paths in 'paths' into 'st', setting res[i] to 0,
+// or to < 0 if paths[i] cannot be stat'ed.  Takes one request for as
+// many paths as fit in a page.
+//
+// Returns 0 on success, < 0 if the file server cannot be asked.
+int
+stat_paths(const char **paths, struct Stat *st, int *res, int n)
+{
+	struct Fsret_path_stat *ret;
+	char *buf = fsipcbuf.stat_paths.req_paths;
+	size_t len, pos;
+	int i, j, r;
+
+	for (i = 0; i < n; i += r) {
+		// A path that is too long goes as "", to keep its place
+		for (j = i, pos = 0; j < n && j - i < STAT_PATHS_MAX; j++) {
+			len = strlen(paths[j]) < MAXPATHLEN ? strlen(paths[j]) : 0;
+			if (pos + len + 1 > sizeof(fsipcbuf.stat_paths.req_paths))
+				break;
+			memmove(buf + pos, paths[j], len);
+			buf[pos + len] = '\0';
+			pos += len + 1;
+		}
+		fsipcbuf.stat_paths.req_n = j - i;
+		if ((r = fsipc(FSREQ_STAT_PATHS, NULL)) < 0)
+			return r;
+		if (r == 0 || r > j - i)
+			return -E_INVAL;
+
+		ret = fsipcbuf.stat_pathsRet.ret_st;
+		for (j = i; j < i + r; j++) {
+			res[j] = ret[j - i].ret_r;
+			if (strlen(paths[j]) >= MAXPATHLEN)
+				res[j] = -E_BAD_PATH;
+			if (res[j] < 0)
+				continue;
+			path_name(paths[j], st[j].st_name);
+			st[j].st_size = ret[j - i].ret_size;
+			st[j].st_isdir = ret[j - i].ret_isdir;
+			st[j].st_gen = ret[j - i].ret_gen;
+			st[j].st_dev = tmpfs_name(paths[j]) ? &devtmp : &devfile;
+		}
+	}
+	return 0;
+}
+
+// Have the file server map the blocks holding up to 'len' bytes of fd,
+// from byte 'offset', at 'va' onwards, writable if 'write' is set.
+// Returns the number of bytes mapped, or < 0 on error, in which case
+// some of the pages may be mapped anyway.
+static int
+fsmap(struct Fd *fd, off_t offset, size_t len, char *va, bool write)
+{
+	int i, n, r;
+
+	fsipcbuf.map_blocks.req_fileid = fd->fd_file.id;
+	fsipcbuf.map_blocks.req_offset = offset;
+	fsipcbuf.map_blocks.req_len = len;
+	fsipcbuf.map_blocks.req_write = write;
+	if ((n = fsipc(FSREQ_MAP_BLOCKS, NULL)) < 0)
+		return n;
+	for (i = 0; i < (PGOFF(offset) + n + PGSIZE - 1) / PGSIZE; i++)
+		if ((r = ipc_recv(NULL, va + i * PGSIZE, NULL)) < 0)
+			return r;
+	return n;
+}
+
+// Map up to 'len' bytes of 'fdnum', starting at byte 'offset',
+// read-only at fd2data(fd), replacing whatever an earlier fmap left
+// there, and point *addr at byte 'offset'.  The pages are the file
+// server's own block cache pages, so they are shared rather than
+// copied; they stay valid until the next fmap on 'fdnum' or until
+// 'fdnum' is closed.
+//
+// Returns the number of bytes mapped, which is short at the end of the
+// file and at PTSIZE, or < 0 on error.
+ssize_t
+fmap(int fdnum, off_t offset, size_t len, void **addr)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+
+	devfile_unmap(fd);
+	if ((r = fsmap(fd, offset, len, fd2data(fd), 0)) < 0) {
+		devfile_unmap(fd);
+		return r;
+	}
+	*addr = fd2data(fd) + PGOFF(offset);
+	return r;
+}
+
+// Map the file block holding byte 'offset' of 'fdnum' with fmap.
+//
+// Returns 0 on success, < 0 on error.
+int
+read_map(int fdnum, off_t offset, void **blk)
+{
+	int r;
+
+	if ((r = fmap(fdnum, offset, 1, blk)) < 0)
+		return r;
+	return 0;
+}
+
+// --------------------------------------------------------------
+// mmap
+// --------------------------------------------------------------
+
+// Mapped files live between MMAPVA and MMAPLIM.  Pages are brought in
+// from the file server's block cache by mmap_pgfault, MMAP_CLUSTER at
+// a time.  Each mapping keeps its own reference to the file's Fd page
+// at MMAPFDVA, so the file stays open after the fd is closed.
+#define MMAPVA		0xB0000000
+#define MMAPLIM		0xD0000000
+#define MMAPFDVA	0xE3000000
+#define NMMAP		16
+#define MMAP_CLUSTER	16
+
+struct Mmap {
+	char *mm_va;		// start of the mapping, 0 if the slot is free
+	size_t mm_len;		// length, rounded up to a page
+	off_t mm_off;		// file offset of mm_va
+	int mm_prot;
+	int mm_flags;
+};
+
+static struct Mmap mmaps[NMMAP];
+
+// The handler mmap_pgfault replaced, which gets all other faults
+extern void (*_pgfault_handler)(struct UTrapframe *utf);
+static void (*mmap_prev_pgfault)(struct UTrapframe *utf);
+
+static struct Fd *
+mmap_fd(struct Mmap *m)
+{
+	return (struct Fd*) (MMAPFDVA + (m - mmaps) * PGSIZE);
+}
+
+static bool
+mmap_mapped(char *va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+// Return the mapping that contains va, or NULL.
+static struct Mmap *
+mmap_find(char *va)
+{
+	struct Mmap *m;
+
+	for (m = mmaps; m < mmaps + NMMAP; m++)
+		if (m->mm_va && va >= m->mm_va && va < m->mm_va + m->mm_len)
+			return m;
+	return NULL;
+}
+
+// Bring in the page at va, and as many of the unmapped pages after it
+// as fit in a cluster.  A private mapping that is written to gets its
+// own copy of the page.
+static void
+mmap_pgfault(struct UTrapframe *utf)
+{
+	char *va = ROUNDDOWN((char*) utf->utf_fault_va, PGSIZE);
+	bool write = utf->utf_err & FEC_WR;
+	struct Mmap *m;
+	size_t n;
+	int r;
+
+	if ((m = mmap_find(va)) == NULL) {
+		if (mmap_prev_pgfault) {
+			mmap_prev_pgfault(utf);
+			return;
+		}
+		panic("page fault at va %08x, eip %08x", utf->utf_fault_va,
+		      utf->utf_eip);
+	}
+	if (write && !(m->mm_prot & PROT_WRITE))
+		panic("mmap: write to read-only mapping at %08x",
+		      utf->utf_fault_va);
+
+	if (!mmap_mapped(va)) {
+		for (n = PGSIZE; n < MMAP_CLUSTER * PGSIZE
+			     && va + n < m->mm_va + m->mm_len
+			     && !mmap_mapped(va + n); n += PGSIZE)
+			/* do nothing */;
+		if ((r = fsmap(mmap_fd(m), m->mm_off + (va - m->mm_va), n, va,
+			       (m->mm_prot & PROT_WRITE)
+			       && (m->mm_flags & MAP_SHARED))) < 0)
+			panic("mmap: fault at %08x: %e", utf->utf_fault_va, r);
+	}
+
+	if (write && !(uvpt[PGNUM(va)] & PTE_W)) {
+		// MAP_PRIVATE: copy the block cache page
+		if ((r = sys_page_alloc(0, PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("mmap: sys_page_alloc: %e", r);
+		memmove(PFTEMP, va, PGSIZE);
+		if ((r = sys_page_map(0, PFTEMP, 0, va, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("mmap: sys_page_map: %e", r);
+		sys_page_unmap(0, PFTEMP);
+	}
+}
+
+// Map 'len' bytes of 'fdnum' from 'offset', which must be page-aligned,
+// and set *addr to where they are.  'prot' is PROT_READ, optionally with
+// PROT_WRITE; 'flags' is MAP_SHARED, whose writes go to the file, or
+// MAP_PRIVATE, whose writes stay in this environment.  Nothing is read
+// until it is touched.
+//
+// Returns 0 on success, < 0 on error.
+int
+mmap(int fdnum, off_t offset, size_t len, int prot, int flags, void **addr)
+{
+	struct Fd *fd;
+	struct Mmap *m, *slot;
+	char *va;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id || PGOFF(offset) || offset < 0
+	    || len == 0 || len > MMAPLIM - MMAPVA
+	    || !(flags & (MAP_SHARED | MAP_PRIVATE)))
+		return -E_INVAL;
+	if ((prot & PROT_WRITE) && (flags & MAP_SHARED)
+	    && (fd->fd_omode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	len = ROUNDUP(len, PGSIZE);
+
+	for (slot = mmaps; slot < mmaps + NMMAP && slot->mm_va; slot++)
+		/* do nothing */;
+	// First fit: move past each mapping in the way, then check again
+	va = (char*) MMAPVA;
+	for (m = mmaps; m < mmaps + NMMAP; m++)
+		if (m->mm_va && va < m->mm_va + m->mm_len && m->mm_va < va + len) {
+			va = m->mm_va + m->mm_len;
+			m = mmaps - 1;
+		}
+	if (slot == mmaps + NMMAP || va + len > (char*) MMAPLIM)
+		return -E_NO_MEM;
+
+	if ((r = sys_page_map(0, fd, 0, mmap_fd(slot),
+			      uvpt[PGNUM(fd)] & PTE_SYSCALL)) < 0)
+		return r;
+	slot->mm_va = va;
+	slot->mm_len = len;
+	slot->mm_off = offset;
+	slot->mm_prot = prot;
+	slot->mm_flags = flags;
+
+	if (_pgfault_handler != mmap_pgfault) {
+		mmap_prev_pgfault = _pgfault_handler;
+		set_pgfault_handler(mmap_pgfault);
+	}
+	*addr = va;
+	return 0;
+}
+
+// Write back the pages of the MAP_SHARED mapping at 'addr' that have
+// been written to.  Returns 0 on success, < 0 on error.
+int
+msync(void *addr)
+{
+	struct Mmap *m;
+	char *va, *run;
+	int r;
+
+	if ((m = mmap_find(addr)) == NULL)
+		return -E_INVAL;
+	if (!(m->mm_prot & PROT_WRITE) || !(m->mm_flags & MAP_SHARED))
+		return 0;
+
+	// One request for each run of dirty pages
+	run = NULL;
+	for (va = m->mm_va; va <= m->mm_va + m->mm_len; va += PGSIZE) {
+		if (va < m->mm_va + m->mm_len && mmap_mapped(va)
+		    && (uvpt[PGNUM(va)] & PTE_D)) {
+			if (!run)
+				run = va;
+			continue;
+		}
+		if (!run)
+			continue;
+		fsipcbuf.dirty.req_fileid = mmap_fd(m)->fd_file.id;
+		fsipcbuf.dirty.req_offset = m->mm_off + (run - m->mm_va);
+		fsipcbuf.dirty.req_len = va - run;
+		if ((r = fsipc(FSREQ_DIRTY, NULL)) < 0)
+			return r;
+		run = NULL;
+	}
+	return 0;
+}
+
+// Write back and remove the mapping that starts at 'addr'.
+// Returns 0 on success, < 0 on error.
+int
+munmap(void *addr)
+{
+	struct Mmap *m;
+	char *va;
+	int r;
+
+	if ((m = mmap_find(addr)) == NULL || m->mm_va != addr)
+		return -E_INVAL;
+	r = msync(addr);
+	for (va = m->mm_va; va < m->mm_va + m->mm_len; va += PGSIZE)
+		if (mmap_mapped(va))
+			sys_page_unmap(0, va);
+	sys_page_unmap(0, mmap_fd(m));
+	m->mm_va = NULL;
+	return r;
+}
+
+// --------------------------------------------------------------
+// Asynchronous I/O
+// --------------------------------------------------------------
+
+// The region holds the rings at AIOVA, then one data page per slot.
+// Like the bulk I/O window, it is PTE_SHARE, so a child must replace
+// the one it inherits.
+static struct AioRing *aio_ring = (struct AioRing*) AIOVA;
+#define AIODATA(slot)	((union Fsipc*) (AIOVA + (1 + (slot)) * PGSIZE))
+
+static struct AioOp {
+	uint32_t ao_op;		// request in the slot, 0 if it is free
+	void *ao_buf;		// where the result of a read or stat goes
+	bool ao_done;		// the result is in
+	int ao_result;
+} aio_ops[AIO_NSLOTS];
+
+static envid_t aio_owner;	// the env whose region is at AIOVA
+
+// Set up this environment's asynchronous I/O region with the file
+// server, unless that is already done.  Returns 0 on success, < 0 on
+// error.
+static int
+aio_setup(void)
+{
+	int r;
+
+	if (aio_owner == thisenv->env_id)
+		return 0;
+
+	if ((r = fsipc_region(FSREQ_AIO_SETUP, (char*) AIOVA, AIO_NPAGES)) < 0)
+		return r;
+	memset(aio_ring, 0, sizeof(*aio_ring));
+	memset(aio_ops, 0, sizeof(aio_ops));
+	aio_owner = thisenv->env_id;
+	return 0;
+}
+
+// Take a free slot for request 'op', whose result goes to 'buf'.
+// Returns the slot, or < 0 on error.
+static int
+aio_slot(uint32_t op, void *buf)
+{
+	int i, r;
+
+	if ((r = aio_setup()) < 0)
+		return r;
+	for (i = 0; i < AIO_NSLOTS; i++)
+		if (aio_ops[i].ao_op == 0) {
+			aio_ops[i].ao_op = op;
+			aio_ops[i].ao_buf = buf;
+			aio_ops[i].ao_done = 0;
+			return i;
+		}
+	return -E_NO_MEM;
+}
+
+// Queue the request in 'slot' on the submission ring.  The server
+// takes entries until it finds the ring empty, so only a ring that
+// it may have found empty needs the doorbell.  Returns 'slot'.
+static int
+aio_submit(int slot, int fileid, size_t n, off_t offset)
+{
+	uint32_t tail = aio_ring->ar_sq_tail;
+	struct AioSqe *sqe = &aio_ring->ar_sq[tail % AIO_NSLOTS];
+
+	sqe->sqe_op = aio_ops[slot].ao_op;
+	sqe->sqe_slot = slot;
+	sqe->sqe_fileid = fileid;
+	sqe->sqe_n = n;
+	sqe->sqe_offset = offset;
+	aio_ring->ar_sq_tail = tail + 1;
+
+	__sync_synchronize();
+	if (aio_ring->ar_sq_head == tail)
+		ipc_send(fsenv(), FSREQ_AIO, 0, 0);
+	return slot;
+}
+
+// Find the file ID behind 'fdnum', which must be a file.
+static int
+aio_fileid(int fdnum)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	return fd->fd_file.id;
+}
+
+// Queue a read of up to 'n' bytes, and no more than a page, from byte
+// 'offset' of 'fdnum' into 'buf'.  The seek position is left alone.
+//
+// Returns an ID to give to aio_wait, which returns the number of bytes
+// read, or < 0 on error.
+int
+aio_read(int fdnum, void *buf, size_t n, off_t offset)
+{
+	int fileid, slot;
+
+	if ((fileid = aio_fileid(fdnum)) < 0)
+		return fileid;
+	if ((slot = aio_slot(FSREQ_READ, buf)) < 0)
+		return slot;
+	return aio_submit(slot, fileid, MIN(n, PGSIZE), offset);
+}
+
+// Queue a write of up to a page of 'buf', like aio_read.  The data is
+// copied before aio_write returns.
+int
+aio_write(int fdnum, const void *buf, size_t n, off_t offset)
+{
+	int fileid, slot;
+
+	if ((fileid = aio_fileid(fdnum)) < 0)
+		return fileid;
+	if ((slot = aio_slot(FSREQ_WRITE, NULL)) < 0)
+		return slot;
+	n = MIN(n, PGSIZE);
+	memmove(AIODATA(slot), buf, n);
+	return aio_submit(slot, fileid, n, offset);
+}
+
+// Queue a stat of 'fdnum' into '*st'.  aio_wait returns 0 or < 0.
+int
+aio_stat(int fdnum, struct Stat *st)
+{
+	int fileid, slot;
+
+	if ((fileid = aio_fileid(fdnum)) < 0)
+		return fileid;
+	if ((slot = aio_slot(FSREQ_STAT, st)) < 0)
+		return slot;
+	return aio_submit(slot, fileid, 0, 0);
+}
+
+// Queue an open of 'path' in 'mode'.  aio_wait returns the new file
+// descriptor, or < 0 on error.
+int
+aio_open(const char *path, int mode)
+{
+	int slot;
+
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	if ((slot = aio_slot(FSREQ_OPEN, NULL)) < 0)
+		return slot;
+	strcpy(AIODATA(slot)->open.req_path, path);
+	AIODATA(slot)->open.req_omode = mode;
+	return aio_submit(slot, 0, 0, 0);
+}
+
+// Take whatever results the server has posted.
+static void
+aio_reap(void)
+{
+	struct AioCqe *cqe;
+
+	for (; aio_ring->ar_cq_head != aio_ring->ar_cq_tail; aio_ring->ar_cq_head++) {
+		cqe = &aio_ring->ar_cq[aio_ring->ar_cq_head % AIO_NSLOTS];
+		if (cqe->cqe_slot < AIO_NSLOTS) {
+			aio_ops[cqe->cqe_slot].ao_result = cqe->cqe_result;
+			aio_ops[cqe->cqe_slot].ao_done = 1;
+		}
+	}
+}
+
+// Wait for the request that returned 'id' to finish, and return its
+// result.  An asynchronous open hands us only a file ID; getting the
+// Fd page takes one more request, but one that the server answers
+// without going near the disk.  Returns -E_NOT_FOUND if the server has
+// dropped the region, which takes the requests in flight with it.
+int
+aio_wait(int id)
+{
+	struct AioOp *op;
+	struct Stat *st;
+	struct Fd *fd;
+	int r;
+
+	if (id < 0 || id >= AIO_NSLOTS || aio_owner != thisenv->env_id
+	    || aio_ops[id].ao_op == 0)
+		return -E_INVAL;
+	op = &aio_ops[id];
+
+	for (aio_reap(); !op->ao_done; aio_reap()) {
+		// Nobody else maps the ring: the server has let go of the
+		// region, and no result is coming
+		if (pageref(aio_ring) < 2) {
+			aio_owner = 0;
+			op->ao_op = 0;
+			return -E_NOT_FOUND;
+		}
+		sys_yield();
+	}
+
+	if ((r = op->ao_result) < 0)
+		goto done;
+	switch (op->ao_op) {
+	case FSREQ_READ:
+		memmove(op->ao_buf, AIODATA(id), r);
+		break;
+	case FSREQ_STAT:
+		st = op->ao_buf;
+		strcpy(st->st_name, AIODATA(id)->statRet.ret_name);
+		st->st_size = AIODATA(id)->statRet.ret_size;
+		st->st_isdir = AIODATA(id)->statRet.ret_isdir;
+		st->st_gen = AIODATA(id)->statRet.ret_gen;
+		break;
+	case FSREQ_OPEN:
+		if ((r = fd_alloc(&fd)) < 0)
+			break;
+		fsipcbuf.claim.req_fileid = op->ao_result;
+		if ((r = fsipc(FSREQ_CLAIM, fd)) < 0) {
+			fd_close(fd, 0);
+			break;
+		}
+		r = fd2num(fd);
+		break;
+	}
+
+done:
+	op->ao_op = 0;
+	return r;
+}
+
+// Fetch the file server's statistics.
+int
+fsstats(struct FsStats *st)
+{
+	int r;
+
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.statsRet;
+	return 0;
+}
+
+// Delete a file.  Only files in the tmpfs can be removed so far.
+int
+remove(const char *path)
+{
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.remove.req_path, path);
+	return fsipc(FSREQ_REMOVE, NULL);
+}
 
 // Synchronize disk with buffer cache
 int
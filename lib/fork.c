@@ -8,6 +8,12 @@
 #define PTE_COW		0x800
 
 extern void _pgfault_upcall(void);
+extern void (*_pgfault_handler)(struct UTrapframe *utf);
+
+// The handler that was installed before fork's own (mmap's, say),
+// which gets the faults that are not copy-on-write writes.
+static void (*fork_prev_pgfault)(struct UTrapframe *utf);
+
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -19,6 +25,13 @@ pgfault(struct UTrapframe *utf)
 	uint32_t err = utf->utf_err;
 	int r;
 
+    if (fork_prev_pgfault && (!(err & FEC_WR) || !(uvpd[PDX(addr)] & PTE_P)
+                              || !(uvpt[PGNUM(addr)] & PTE_COW)))
+    {
+        fork_prev_pgfault(utf);
+        return;
+    }
+
 	// Check that the faulting access was (1) a write, and (2) to a
 	// copy-on-write page.  If not, panic.
 	// Hint:
@@ -140,7 +153,11 @@ fork(void)
     envid_t envid;
     uintptr_t addr;
 
-    set_pgfault_handler(pgfault);
+    if (_pgfault_handler != pgfault)
+    {
+        fork_prev_pgfault = _pgfault_handler;
+        set_pgfault_handler(pgfault);
+    }
 
     envid = sys_exofork();
     if (envid < 0)
@@ -3,13 +3,11 @@
 
 #include <inc/lib.h>
 
-extern void umain(int argc, char **argv);
-
 const volatile struct Env *thisenv;
 const char *binaryname = "<unknown>";
 
 void
-libmain(int argc, char **argv)
+libmain(void (*main)(int argc, char **argv), int argc, char **argv)
 {
 	// set thisenv to point at our Env structure in envs[].
 	// LAB 3: Your code here.
@@ -22,8 +20,14 @@ libmain(int argc, char **argv)
 	if (argc > 0)
 		binaryname = argv[0];
 
+	// a negative argc means we were spawned as a zygote (see spawn.c)
+	if (argc < 0) {
+		binaryname = argv[0];
+		zygote_serve(main);
+	}
+
 	// call user main routine
-	umain(argc, argv);
+	main(argc, argv);
 
 	// exit gracefully
 	exit();
@@ -1,15 +1,82 @@
 #include <inc/lib.h>
 #include <inc/elf.h>
+#include <inc/x86.h>
 
 #define UTEMP2USTACK(addr)	((void*) (addr) + (USTACKTOP - PGSIZE) - UTEMP)
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// Zygotes.
+//
+// A zygote is an instance of a program that has been loaded and started
+// but stops short of umain(): it waits in zygote_serve() and fork()s a
+// copy-on-write clone of itself for each spawn request.  Cloning only
+// remaps pages, where a cold spawn reads every data page of the binary
+// through the file server.
+//
+// Zygotes are recorded in a registry page mapped PTE_SHARE at ZYGOTEVA,
+// so every descendant of the env that first spawned through it (in
+// practice, everything below init) sees the same zygotes.  A program gets
+// a zygote once it has been spawned ZYGOTE_HOT times.
+//
+// The kernel only lets an env map pages into itself or its own children,
+// so neither the file server nor a separate spawn server could hand a
+// preloaded image to somebody else's child; the zygote itself does it.
+//
+// So a clone is the zygote's child, not the spawner's, and the kernel
+// has no call to change an env's parent.  wait() only watches the env
+// ID, and the spawner passes its shared pages over by IPC, so neither
+// cares; but env_parent_id names the zygote, and the spawner cannot
+// sys_env_destroy the clone or set its status or trapframe.  If the
+// hand-over fails, the spawner asks the clone to exit (ZYGOTE_ABORT).
+#define ZYGOTEVA	0xE0000000		// zygote registry page
+#define ZYGOTEARGV	(ZYGOTEVA + PGSIZE)	// argv for a new clone
+#define NZYGOTE		16	// programs tracked in the registry
+#define NZYGOTELIVE	4	// programs that may hold a zygote at once
+#define ZYGOTE_HOT	2	// cold spawns before a program gets a zygote
+
+// Requests sent to a zygote, and the message that lets a clone run.
+#define ZYGOTE_SPAWN	1
+#define ZYGOTE_EXIT	2
+#define ZYGOTE_GO	1	// not page aligned, so never a shared page
+#define ZYGOTE_ABORT	2	// likewise
+
+struct Zygote {
+	char z_path[MAXNAMELEN];
+	envid_t z_envid;	// zygote for z_path, or 0 if there is none
+	off_t z_size;		// size of z_path when the zygote loaded it
+	uint32_t z_gen;		// and its st_gen
+	uint32_t z_spawns;	// spawns of z_path, for hotness and eviction
+};
+
+struct ZygoteTab {
+	volatile uint32_t zt_lock;
+	struct Zygote zt_ent[NZYGOTE];
+};
+
+// Argument page handed to a clone at ZYGOTEARGV.  It is shared with
+// the spawner, which waits for the zygote to fill in za_child.
+struct ZygoteArgs {
+	volatile envid_t za_child;	// the clone, < 0 on error, 0 until set
+	int za_argc;
+	char *za_argv[];
+};
+
 // Helper functions for spawn.
-static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
+static int spawn_image(const char *prog, const char **argv, bool zygote,
+		       struct Stat *st);
+static int zygote_spawn(const char *prog, const char **argv);
+static void zygote_note(const char *prog);
+static int init_stack(envid_t child, const char **argv, bool zygote,
+		      uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
 		       int fd, size_t filesz, off_t fileoffset, int perm);
 static int copy_shared_pages(envid_t child);
+static int map_libjos(envid_t child);
+
+// The shared libjos image, mapped at LIBJOSVA in programs linked with
+// user/userdyn.ld.
+#define LIBJOS_PATH	"/libjos"
 
 // Spawn a child process from a program image loaded from the file system.
 // prog: the pathname of the program to run.
@@ -18,12 +85,32 @@ static int copy_shared_pages(envid_t child);
 // Returns child envid on success, < 0 on failure.
 int
 spawn(const char *prog, const char **argv)
+{
+	struct Stat st;
+	int r;
+
+	// Whatever goes wrong with a zygote, a cold spawn may still work
+	if ((r = zygote_spawn(prog, argv)) >= 0)
+		return r;
+	if ((r = spawn_image(prog, argv, 0, &st)) >= 0)
+		zygote_note(prog);
+	return r;
+}
+
+// Load 'prog' into a new child and start it.  A zygote child gets a
+// negative argc, which sends libmain() to zygote_serve(), and does not
+// inherit our shared pages: a zygote holding a pipe end open would keep
+// the pipe from ever reporting EOF.
+// Stores the program file's Stat in *st.
+static int
+spawn_image(const char *prog, const char **argv, bool zygote, struct Stat *st)
 {
 	unsigned char elf_buf[512];
 	struct Trapframe child_tf;
 	envid_t child;
 
 	int fd, i, r;
+	bool libjos;
 	struct Elf *elf;
 	struct Proghdr *ph;
 	int perm;
@@ -97,6 +184,10 @@ spawn(const char *prog, const char **argv)
 		cprintf("elf magic %08x want %08x\n", elf->e_magic, ELF_MAGIC);
 		return -E_NOT_EXEC;
 	}
+	if ((r = fstat(fd, st)) < 0) {
+		close(fd);
+		return r;
+	}
 
 	// Create new child environment
 	if ((r = sys_exofork()) < 0)
@@ -107,12 +198,15 @@ spawn(const char *prog, const char **argv)
 	child_tf = envs[ENVX(child)].env_tf;
 	child_tf.tf_eip = elf->e_entry;
 
-	if ((r = init_stack(child, argv, &child_tf.tf_esp)) < 0)
+	if ((r = init_stack(child, argv, zygote, &child_tf.tf_esp)) < 0)
 		return r;
 
 	// Set up program segments as defined in ELF header.
+	libjos = 0;
 	ph = (struct Proghdr*) (elf_buf + elf->e_phoff);
 	for (i = 0; i < elf->e_phnum; i++, ph++) {
+		if (ph->p_type == ELF_PROG_LIBJOS)
+			libjos = 1;
 		if (ph->p_type != ELF_PROG_LOAD)
 			continue;
 		perm = PTE_P | PTE_U;
@@ -125,8 +219,11 @@ spawn(const char *prog, const char **argv)
 	close(fd);
 	fd = -1;
 
+	if (libjos && (r = map_libjos(child)) < 0)
+		goto error;
+
 	// Copy shared library state.
-	if ((r = copy_shared_pages(child)) < 0)
+	if (!zygote && (r = copy_shared_pages(child)) < 0)
 		panic("copy_shared_pages: %e", r);
 
 	if ((r = sys_env_set_trapframe(child, &child_tf)) < 0)
@@ -178,12 +275,13 @@ spawnl(const char *prog, const char *arg0, ...)
 // Set up the initial stack page for the new child process with envid 'child'
 // using the arguments array pointed to by 'argv',
 // which is a null-terminated array of pointers to null-terminated strings.
+// A zygote is passed -argc instead of argc.
 //
 // On success, returns 0 and sets *init_esp
 // to the initial stack pointer with which the child should start.
 // Returns < 0 on failure.
 static int
-init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
+init_stack(envid_t child, const char **argv, bool zygote, uintptr_t *init_esp)
 {
 	size_t string_size;
 	int argc, i, r;
@@ -241,7 +339,7 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 	assert(string_store == (char*)UTEMP + PGSIZE);
 
 	argv_store[-1] = UTEMP2USTACK(argv_store);
-	argv_store[-2] = argc;
+	argv_store[-2] = zygote ? -argc : argc;
 
 	*init_esp = UTEMP2USTACK(&argv_store[-2]);
 
@@ -265,6 +363,8 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 {
 	int i, r;
 	void *blk;
+	char *text = NULL;		// file pages [textoff, textoff + textlen)
+	size_t textoff = 0, textlen = 0;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -280,6 +380,19 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 			// allocate a blank page
 			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
 				return r;
+		} else if (!(perm & PTE_W) && filesz >= memsz) {
+			// text: share the file server's copy of the blocks,
+			// fetching as many of them at once as fmap will
+			if (i < textoff || i >= textoff + textlen) {
+				if ((r = fmap(fd, fileoffset + i, filesz - i, &blk)) < 0)
+					return r;
+				text = blk;
+				textoff = i;
+				textlen = r;
+			}
+			if ((r = sys_page_map(0, text + (i - textoff), child,
+					      (void*) (va + i), perm)) < 0)
+				panic("spawn: sys_page_map text: %e", r);
 		} else {
 			// from file
 			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
@@ -296,6 +409,42 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 	return 0;
 }
 
+// Map the shared libjos image into the child: text shared through
+// fmap() like any program's, data and bss private.
+static int
+map_libjos(envid_t child)
+{
+	unsigned char elf_buf[512];
+	struct Elf *elf;
+	struct Proghdr *ph;
+	int fd, i, perm, r;
+
+	if ((r = open(LIBJOS_PATH, O_RDONLY)) < 0)
+		return r;
+	fd = r;
+
+	elf = (struct Elf*) elf_buf;
+	if (readn(fd, elf_buf, sizeof(elf_buf)) != sizeof(elf_buf)
+	    || elf->e_magic != ELF_MAGIC) {
+		close(fd);
+		return -E_NOT_EXEC;
+	}
+
+	ph = (struct Proghdr*) (elf_buf + elf->e_phoff);
+	for (i = 0; i < elf->e_phnum; i++, ph++) {
+		if (ph->p_type != ELF_PROG_LOAD)
+			continue;
+		perm = PTE_P | PTE_U;
+		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
+			perm |= PTE_W;
+		if ((r = map_segment(child, ph->p_va, ph->p_memsz,
+				     fd, ph->p_filesz, ph->p_offset, perm)) < 0)
+			break;
+	}
+	close(fd);
+	return r;
+}
+
 // Copy the mappings for shared pages into the child address space.
 static int
 copy_shared_pages(envid_t child)
@@ -317,3 +466,296 @@ copy_shared_pages(envid_t child)
 
     return 0;
 }
+
+// Map the zygote registry, creating it if nobody above us has.
+static struct ZygoteTab *
+zygote_tab(void)
+{
+	if (!(uvpd[PDX(ZYGOTEVA)] & PTE_P) || !(uvpt[PGNUM(ZYGOTEVA)] & PTE_P))
+		if (sys_page_alloc(0, (void*) ZYGOTEVA,
+				   PTE_P|PTE_U|PTE_W|PTE_SHARE) < 0)
+			return 0;
+	return (struct ZygoteTab*) ZYGOTEVA;
+}
+
+static void
+zygote_lock(struct ZygoteTab *zt)
+{
+	while (xchg(&zt->zt_lock, 1) != 0)
+		sys_yield();
+}
+
+static void
+zygote_unlock(struct ZygoteTab *zt)
+{
+	xchg(&zt->zt_lock, 0);
+}
+
+static bool
+zygote_alive(envid_t zid)
+{
+	const volatile struct Env *e = &envs[ENVX(zid)];
+
+	return zid != 0 && e->env_id == zid
+		&& e->env_status != ENV_FREE && e->env_status != ENV_DYING;
+}
+
+// Find the registry entry for 'prog'.  Called with the registry locked.
+static struct Zygote *
+zygote_find(struct ZygoteTab *zt, const char *prog)
+{
+	int i;
+
+	for (i = 0; i < NZYGOTE; i++)
+		if (zt->zt_ent[i].z_path[0]
+		    && strcmp(zt->zt_ent[i].z_path, prog) == 0)
+			return &zt->zt_ent[i];
+	return 0;
+}
+
+// Like ipc_send, but gives up if 'to_env' has gone away.
+static int
+zygote_send(envid_t to_env, uint32_t val, void *pg, int perm)
+{
+	int r;
+
+	while ((r = sys_ipc_try_send(to_env, val, pg ? pg : (void*) UTOP, perm))
+	       == -E_IPC_NOT_RECV)
+		sys_yield();
+	return r;
+}
+
+// Build the argument page for a clone at UTEMP,
+// with pointers that are valid at ZYGOTEARGV.
+static int
+zygote_args(const char **argv)
+{
+	struct ZygoteArgs *za = (struct ZygoteArgs*) UTEMP;
+	char *s;
+	int argc, len, r;
+
+	for (argc = 0; argv[argc] != 0; argc++)
+		/* do nothing */;
+	if ((r = sys_page_alloc(0, (void*) UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+
+	s = (char*) &za->za_argv[argc + 1];
+	for (za->za_argc = 0; za->za_argc < argc; za->za_argc++) {
+		len = strlen(argv[za->za_argc]) + 1;
+		if (s + len > (char*) UTEMP + PGSIZE) {
+			sys_page_unmap(0, (void*) UTEMP);
+			return -E_NO_MEM;
+		}
+		memmove(s, argv[za->za_argc], len);
+		za->za_argv[za->za_argc] = (char*) ZYGOTEARGV + (s - (char*) UTEMP);
+		s += len;
+	}
+	za->za_argv[argc] = 0;
+	za->za_child = 0;
+	return 0;
+}
+
+// Spawn 'prog' by cloning its zygote.
+// Returns the child envid, -E_NOT_FOUND if 'prog' has no usable zygote,
+// or another error.
+static int
+zygote_spawn(const char *prog, const char **argv)
+{
+	struct ZygoteArgs *za = (struct ZygoteArgs*) UTEMP;
+	struct ZygoteTab *zt;
+	struct Zygote *z;
+	struct Stat st;
+	envid_t zid;
+	uintptr_t va;
+	off_t size;
+	uint32_t gen;
+	int child, r;
+
+	if (!(zt = zygote_tab()))
+		return -E_NOT_FOUND;
+	zid = 0;
+	size = 0;
+	gen = 0;
+	zygote_lock(zt);
+	if ((z = zygote_find(zt, prog))) {
+		if (!zygote_alive(z->z_envid))
+			z->z_envid = 0;
+		zid = z->z_envid;
+		size = z->z_size;
+		gen = z->z_gen;
+		z->z_spawns++;
+	}
+	zygote_unlock(zt);
+	if (!zid)
+		return -E_NOT_FOUND;
+
+	// The zygote holds the image it was loaded from; retire it if the
+	// program file has been opened for writing since.
+	if ((r = stat(prog, &st)) < 0)
+		return r;
+	if (st.st_size != size || st.st_gen != gen) {
+		zygote_lock(zt);
+		if (z->z_envid == zid)
+			z->z_envid = 0;
+		zygote_unlock(zt);
+		zygote_send(zid, ZYGOTE_EXIT, 0, 0);
+		return -E_NOT_FOUND;
+	}
+
+	// The reply comes back in the argument page rather than by IPC,
+	// so that we neither take other envs' messages nor wait forever
+	// on a zygote that dies before it answers.
+	if ((r = zygote_args(argv)) < 0)
+		return r;
+	r = zygote_send(zid, ZYGOTE_SPAWN, (void*) UTEMP,
+			PTE_P|PTE_U|PTE_W|PTE_SHARE);
+	while (r >= 0 && za->za_child == 0 && zygote_alive(zid))
+		sys_yield();
+	child = r < 0 ? 0 : za->za_child;
+	sys_page_unmap(0, (void*) UTEMP);
+	if (child == 0)
+		return -E_NOT_FOUND;
+	if (child < 0)
+		return child;
+
+	// Hand the clone the pages copy_shared_pages() would have given it,
+	// then let it run.
+	for (va = 0; va < USTACKTOP; va += PGSIZE)
+		if ((uvpd[PDX(va)] & PTE_P)
+		    && (uvpt[PGNUM(va)] & (PTE_P|PTE_U|PTE_SHARE)) == (PTE_P|PTE_U|PTE_SHARE)
+		    && (r = zygote_send(child, va, (void*) va,
+					uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+			goto abort;
+	if ((r = zygote_send(child, ZYGOTE_GO, 0, 0)) < 0)
+		goto abort;
+	return child;
+
+abort:
+	// The clone is the zygote's child, so we cannot destroy it
+	zygote_send(child, ZYGOTE_ABORT, 0, 0);
+	return r;
+}
+
+// Record a cold spawn of 'prog', and start a zygote for it
+// once it is hot enough.
+static void
+zygote_note(const char *prog)
+{
+	const char *argv[2] = { prog, 0 };
+	struct ZygoteTab *zt;
+	struct Zygote *z, *victim;
+	struct Stat st;
+	envid_t evict, zid;
+	int i, nlive;
+
+	if (strlen(prog) >= MAXNAMELEN || !(zt = zygote_tab()))
+		return;
+
+	zygote_lock(zt);
+	if (!(z = zygote_find(zt, prog))) {
+		// Reuse the least spawned slot that has no zygote.
+		for (i = 0; i < NZYGOTE; i++) {
+			victim = &zt->zt_ent[i];
+			if (zygote_alive(victim->z_envid))
+				continue;
+			if (!z || victim->z_spawns < z->z_spawns)
+				z = victim;
+		}
+		if (!z) {
+			zygote_unlock(zt);
+			return;
+		}
+		strcpy(z->z_path, prog);
+		z->z_envid = 0;
+		z->z_spawns = 0;
+	}
+	if (++z->z_spawns < ZYGOTE_HOT || zygote_alive(z->z_envid)) {
+		zygote_unlock(zt);
+		return;
+	}
+
+	// Make room by retiring the least spawned zygote.
+	nlive = 0;
+	victim = 0;
+	for (i = 0; i < NZYGOTE; i++) {
+		if (!zygote_alive(zt->zt_ent[i].z_envid))
+			continue;
+		nlive++;
+		if (!victim || zt->zt_ent[i].z_spawns < victim->z_spawns)
+			victim = &zt->zt_ent[i];
+	}
+	evict = 0;
+	if (nlive >= NZYGOTELIVE) {
+		evict = victim->z_envid;
+		victim->z_envid = 0;
+	}
+	zygote_unlock(zt);
+
+	if (evict)
+		zygote_send(evict, ZYGOTE_EXIT, 0, 0);
+	if ((zid = spawn_image(prog, argv, 1, &st)) < 0)
+		return;
+
+	zygote_lock(zt);
+	if (strcmp(z->z_path, prog) == 0 && !zygote_alive(z->z_envid)) {
+		z->z_envid = zid;
+		z->z_size = st.st_size;
+		z->z_gen = st.st_gen;
+		zid = 0;
+	}
+	zygote_unlock(zt);
+	// Somebody else started one first.
+	if (zid)
+		zygote_send(zid, ZYGOTE_EXIT, 0, 0);
+}
+
+// Receive the spawner's shared pages, then become the program.
+static void
+zygote_clone(envid_t spawner, void (*main)(int argc, char **argv))
+{
+	struct ZygoteArgs *za = (struct ZygoteArgs*) ZYGOTEARGV;
+	envid_t from;
+	uint32_t va;
+	int perm;
+
+	for (;;) {
+		va = ipc_recv(&from, (void*) UTEMP, &perm);
+		if (from != spawner)
+			continue;
+		if (va == ZYGOTE_GO)
+			break;
+		if (va == ZYGOTE_ABORT)
+			exit();
+		if (!(perm & PTE_P))
+			continue;
+		if (sys_page_map(0, (void*) UTEMP, 0, (void*) va, perm) < 0)
+			panic("zygote: cannot map shared page %08x", va);
+		sys_page_unmap(0, (void*) UTEMP);
+	}
+
+	if (za->za_argc > 0)
+		binaryname = za->za_argv[0];
+	main(za->za_argc, za->za_argv);
+	exit();
+}
+
+// Called by libmain() instead of umain() when we were spawned as a zygote.
+// Never returns.
+void
+zygote_serve(void (*main)(int argc, char **argv))
+{
+	envid_t whom, child;
+	int req, perm;
+
+	for (;;) {
+		req = ipc_recv(&whom, (void*) ZYGOTEARGV, &perm);
+		if (req == ZYGOTE_EXIT)
+			exit();
+		if (req != ZYGOTE_SPAWN || !(perm & PTE_P))
+			continue;
+		if ((child = fork()) == 0)
+			zygote_clone(whom, main);
+		((struct ZygoteArgs*) ZYGOTEARGV)->za_child = child;
+		sys_page_unmap(0, (void*) ZYGOTEARGV);
+	}
+}
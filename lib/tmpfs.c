@@ -0,0 +1,172 @@
+#include <inc/lib.h>
+
+#define debug 0
+
+// The request page, shared with file.c
+extern union Fsipc fsipcbuf;
+
+// Files of the tmpfs mounted at /tmp (see struct TmpHdr).  The file's
+// TmpHdr page is at fd2data(fd) and its data follows; data pages are
+// mapped as they are first needed.
+
+static ssize_t devtmp_read(struct Fd *fd, void *buf, size_t n);
+static ssize_t devtmp_write(struct Fd *fd, const void *buf, size_t n);
+static int devtmp_close(struct Fd *fd);
+static int devtmp_stat(struct Fd *fd, struct Stat *stat);
+static int devtmp_trunc(struct Fd *fd, off_t newsize);
+
+struct Dev devtmp =
+{
+	.dev_id =	't',
+	.dev_name =	"tmp",
+	.dev_read =	devtmp_read,
+	.dev_write =	devtmp_write,
+	.dev_close =	devtmp_close,
+	.dev_stat =	devtmp_stat,
+	.dev_trunc =	devtmp_trunc
+};
+
+// If 'path' is in the tmpfs, return the rest of it after "/tmp/",
+// which is "" for /tmp itself.  Otherwise return NULL.
+const char *
+tmpfs_name(const char *path)
+{
+	while (*path == '/')
+		path++;
+	if (strncmp(path, "tmp", 3) != 0 || (path[3] != '/' && path[3] != '\0'))
+		return NULL;
+	for (path += 3; *path == '/'; path++)
+		/* do nothing */;
+	return path;
+}
+
+// Open 'path', which is in the tmpfs.  Called by open.
+int
+tmpfs_open(const char *path, int mode)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_alloc(&fd)) < 0)
+		return r;
+
+	// The server sends the Fd page, then the TmpHdr page
+	strcpy(fsipcbuf.open.req_path, path);
+	fsipcbuf.open.req_omode = mode;
+	if ((r = fsipc(FSREQ_TMP_OPEN, fd)) < 0)
+		return r;
+	if ((r = ipc_recv(NULL, fd2data(fd), NULL)) < 0) {
+		sys_page_unmap(0, fd);
+		return r;
+	}
+	return fd2num(fd);
+}
+
+// Map whichever pages holding bytes 'offset' to 'offset + n' of fd are
+// not mapped yet.  Returns 0 on success, < 0 on error.
+static int
+tmpfs_map(struct Fd *fd, off_t offset, size_t n)
+{
+	char *data = fd2data(fd) + PGSIZE;
+	off_t pos;
+	int i, r;
+
+	for (pos = ROUNDDOWN(offset, PGSIZE); pos < offset + n; pos += PGSIZE) {
+		if ((uvpd[PDX(data + pos)] & PTE_P)
+		    && (uvpt[PGNUM(data + pos)] & PTE_P))
+			continue;
+
+		fsipcbuf.map_blocks.req_fileid = fd->fd_file.id;
+		fsipcbuf.map_blocks.req_offset = pos;
+		fsipcbuf.map_blocks.req_len = offset + n - pos;
+		if ((r = fsipc(FSREQ_TMP_MAP, NULL)) < 0)
+			return r;
+		for (i = 0; i < (r + PGSIZE - 1) / PGSIZE; i++)
+			if ((r = ipc_recv(NULL, data + pos + i * PGSIZE, NULL)) < 0)
+				return r;
+	}
+	return 0;
+}
+
+static ssize_t
+devtmp_read(struct Fd *fd, void *buf, size_t n)
+{
+	struct TmpHdr *th = (struct TmpHdr*) fd2data(fd);
+	int r;
+
+	if (debug)
+		cprintf("[%08x] devtmp_read %s %d at %d\n", thisenv->env_id,
+			th->th_name, n, fd->fd_offset);
+
+	if (th->th_isdir)
+		return -E_INVAL;
+	if (fd->fd_offset >= th->th_size)
+		return 0;
+	n = MIN(n, th->th_size - fd->fd_offset);
+	if ((r = tmpfs_map(fd, fd->fd_offset, n)) < 0)
+		return r;
+	memmove(buf, fd2data(fd) + PGSIZE + fd->fd_offset, n);
+	fd->fd_offset += n;
+	return n;
+}
+
+// Write in place.  Only growing the file takes a request.
+static ssize_t
+devtmp_write(struct Fd *fd, const void *buf, size_t n)
+{
+	struct TmpHdr *th = (struct TmpHdr*) fd2data(fd);
+	off_t end;
+	int r;
+
+	if (debug)
+		cprintf("[%08x] devtmp_write %s %d at %d\n", thisenv->env_id,
+			th->th_name, n, fd->fd_offset);
+
+	if (fd->fd_offset >= TMP_MAXSIZE)
+		return -E_NO_DISK;
+	n = MIN(n, TMP_MAXSIZE - fd->fd_offset);
+	end = fd->fd_offset + n;
+	if (end > th->th_size) {
+		fsipcbuf.set_size.req_fileid = fd->fd_file.id;
+		fsipcbuf.set_size.req_size = end;
+		if ((r = fsipc(FSREQ_TMP_EXTEND, NULL)) < 0)
+			return r;
+	}
+
+	if ((r = tmpfs_map(fd, fd->fd_offset, n)) < 0)
+		return r;
+	memmove(fd2data(fd) + PGSIZE + fd->fd_offset, buf, n);
+	fd->fd_offset += n;
+	return n;
+}
+
+// Unmap the file's pages.  The server keeps the file.
+static int
+devtmp_close(struct Fd *fd)
+{
+	char *va = fd2data(fd), *end = va + PTSIZE;
+
+	for (; va < end; va += PGSIZE)
+		if ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P))
+			sys_page_unmap(0, va);
+	return 0;
+}
+
+static int
+devtmp_stat(struct Fd *fd, struct Stat *st)
+{
+	struct TmpHdr *th = (struct TmpHdr*) fd2data(fd);
+
+	strcpy(st->st_name, th->th_name);
+	st->st_size = th->th_size;
+	st->st_isdir = th->th_isdir;
+	return 0;
+}
+
+static int
+devtmp_trunc(struct Fd *fd, off_t newsize)
+{
+	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
+	fsipcbuf.set_size.req_size = newsize;
+	return fsipc(FSREQ_TMP_SET_SIZE, NULL);
+}
@@ -7,6 +7,15 @@ cat(int f, char *s)
 {
 	long n;
 	int r;
+	off_t off;
+	void *p;
+
+	// Files: write straight out of the file server's block cache
+	for (off = 0; (n = fmap(f, off, PTSIZE, &p)) > 0; off += n)
+		if ((r = write(1, p, n)) != n)
+			panic("write error copying %s: %e", s, r);
+	if (off > 0)
+		return;
 
 	while ((n = read(f, buf, (long)sizeof(buf))) > 0)
 		if ((r = write(1, buf, n)) != n)
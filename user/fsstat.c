@@ -0,0 +1,23 @@
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	struct FsStats st;
+	int r;
+
+	if ((r = fsstats(&st)) < 0)
+		panic("fsstats: %e", r);
+	cprintf("block cache: %d lookups, %d misses (%d%% hits), %d evictions\n",
+		st.fs_lookups, st.fs_faults,
+		st.fs_lookups ? 100 - (int) ((uint64_t) st.fs_faults * 100 / st.fs_lookups) : 0,
+		st.fs_evictions);
+	cprintf("read-ahead: %d blocks, %d used, window %d\n",
+		st.fs_ra_blocks, st.fs_ra_hits, st.fs_ra_window);
+	cprintf("name cache: %d hits, %d misses\n",
+		st.fs_name_hits, st.fs_name_misses);
+	cprintf("journal: %d commits, %d blocks logged\n",
+		st.fs_commits, st.fs_blocks_logged);
+	cprintf("delayed allocation: %d blocks in %d extents\n",
+		st.fs_blocks_delayed, st.fs_extents);
+}
@@ -80,6 +80,22 @@ send_data(struct http_request *req, int fd)
     char buf[1024];
     memset(buf, 0 , sizeof(buf));
     int bytes_read = 0;
+    off_t off;
+    void *p;
+
+    // Send the file straight from the file server's block cache
+    for (off = 0; (bytes_read = fmap(fd, off, PTSIZE, &p)) > 0; off += bytes_read)
+    {
+        if (bytes_read != write(req->sock, p, bytes_read))
+        {
+            cprintf("send_data: Couldn't write bytes to socket\n");
+            exit();
+        }
+    }
+    if (off > 0)
+    {
+        return 0;
+    }
 
     for(;;)
     {
@@ -1,39 +1,40 @@
 #include <inc/lib.h>
 
+#define NENT	128
+
 int flag[256];
 
+// Entries of the directory being listed, and the command-line
+// files, each NENT at a time
+struct Stat ents[NENT];
+struct Stat args[NENT];
+int res[NENT];
+
 void lsdir(const char*, const char*);
 void ls1(const char*, bool, off_t, const char*);
 
 void
-ls(const char *path, const char *prefix)
+ls(const char *path, const char *prefix, struct Stat *st)
 {
-	int r;
-	struct Stat st;
-
-	if ((r = stat(path, &st)) < 0)
-		panic("stat %s: %e", path, r);
-	if (st.st_isdir && !flag['d'])
+	if (st->st_isdir && !flag['d'])
 		lsdir(path, prefix);
 	else
-		ls1(0, st.st_isdir, st.st_size, path);
+		ls1(0, st->st_isdir, st->st_size, path);
 }
 
 void
 lsdir(const char *path, const char *prefix)
 {
-	int fd, n;
-	struct File f;
+	int fd, i, n;
 
 	if ((fd = open(path, O_RDONLY)) < 0)
 		panic("open %s: %e", path, fd);
-	while ((n = readn(fd, &f, sizeof f)) == sizeof f)
-		if (f.f_name[0])
-			ls1(prefix, f.f_type==FTYPE_DIR, f.f_size, f.f_name);
-	if (n > 0)
-		panic("short read in directory %s", path);
+	while ((n = readdir(fd, ents, NENT)) > 0)
+		for (i = 0; i < n; i++)
+			ls1(prefix, ents[i].st_isdir, ents[i].st_size, ents[i].st_name);
 	if (n < 0)
 		panic("error reading directory %s: %e", path, n);
+	close(fd);
 }
 
 void
@@ -66,11 +67,11 @@ usage(void)
 void
 umain(int argc, char **argv)
 {
-	int i;
-	struct Argstate args;
+	int i, j, n, r;
+	struct Argstate argstate;
 
-	argstart(&argc, argv, &args);
-	while ((i = argnext(&args)) >= 0)
+	argstart(&argc, argv, &argstate);
+	while ((i = argnext(&argstate)) >= 0)
 		switch (i) {
 		case 'd':
 		case 'F':
@@ -81,11 +82,21 @@ umain(int argc, char **argv)
 			usage();
 		}
 
-	if (argc == 1)
-		ls("/", "");
-	else {
-		for (i = 1; i < argc; i++)
-			ls(argv[i], argv[i]);
+	if (argc == 1) {
+		if ((r = stat("/", &args[0])) < 0)
+			panic("stat /: %e", r);
+		ls("/", "", &args[0]);
+		return;
 	}
-}
 
+	for (i = 1; i < argc; i += n) {
+		n = MIN(argc - i, NENT);
+		if ((r = stat_paths((const char**) argv + i, args, res, n)) < 0)
+			panic("stat: %e", r);
+		for (j = 0; j < n; j++) {
+			if (res[j] < 0)
+				panic("stat %s: %e", argv[i + j], res[j]);
+			ls(argv[i + j], argv[i + j], &args[j]);
+		}
+	}
+}